@@ -0,0 +1,444 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+  #include <io.h>
+  #include <malloc.h>
+#else
+  #include <unistd.h>
+#endif
+
+#include "ffmpeg.h"
+#include "spsc_queue.h"
+
+namespace ben {
+
+  struct AsyncWriterOptions
+  {
+    std::size_t budget = 64 * 1024 * 1024;
+    std::size_t block_size = 1024 * 1024;  // rounded up to a multiple of 4096
+    bool direct = false;                   // O_DIRECT for aligned blocks (linux)
+    int64_t preallocate = 0;               // file space reserved on open (bytes)
+  };
+
+  // AVIOContext that writes through a background thread.
+  // the muxer only copies into memory blocks, the writer thread does the file I/O
+  // in block sized writes at the offsets the muxer asked for (seeks included).
+  // memory is bounded by the budget : when every block is in flight the muxer
+  // waits for the disk (counted in stalls()).
+  class AsyncWriter
+  {
+  public:
+    typedef AsyncWriterOptions Options;
+
+  private:
+    static const std::size_t alignment = 4096;
+    static const int io_buffer_size = 64 * 1024;
+
+    struct Block
+    {
+      uint8_t* data = nullptr;
+      std::size_t size = 0;
+      int64_t offset = 0;
+    };
+
+    Options opt_;
+    std::string filename_;
+    int fd_ = -1;
+    int direct_fd_ = -1;
+    AVIOContext* avio_ = nullptr;
+
+    std::vector<Block> blocks_;
+    SpscQueue<Block*> filled_; // muxer -> writer
+    SpscQueue<Block*> free_;   // writer -> muxer
+    Block* current_ = nullptr;
+
+    // muxer side
+    int64_t pos_ = 0;
+    int64_t size_ = 0;
+
+    std::thread thread_;
+    std::atomic<bool> running_{ false };
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    std::atomic<int> error_{ 0 };
+    std::atomic<uint64_t> stalls_{ 0 };
+
+  public:
+    explicit AsyncWriter(const Options& options = Options())
+      : opt_(options),
+      filled_(block_count(options)),
+      free_(block_count(options))
+    {
+      opt_.block_size = (std::max<std::size_t>(opt_.block_size, alignment) + alignment - 1) / alignment * alignment;
+    }
+
+    ~AsyncWriter()
+    {
+      close();
+    }
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    // creates (truncates) the file and starts the writer thread. av error code.
+    // again after close() for another file, AVERROR(EBUSY) while one is open.
+    int open(const std::string& filename)
+    {
+      if (fd_ >= 0 || !blocks_.empty()) {
+        return AVERROR(EBUSY);
+      }
+      filename_ = filename;
+      pos_ = 0;
+      size_ = 0;
+      error_ = 0;
+
+#if defined(_WIN32)
+      fd_ = _open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+      fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+      if (fd_ < 0) {
+        return AVERROR(errno);
+      }
+
+#if defined(__linux__)
+      if (opt_.direct) {
+        // not every filesystem takes it : aligned blocks then go through the page cache too
+        direct_fd_ = ::open(filename.c_str(), O_WRONLY | O_DIRECT);
+        if (direct_fd_ < 0) {
+          av_log(nullptr, AV_LOG_WARNING, "O_DIRECT not available : %s\n", filename.c_str());
+        }
+      }
+#endif
+
+      if (opt_.preallocate > 0) {
+        preallocate(opt_.preallocate);
+      }
+
+      std::size_t count = block_count(opt_);
+      blocks_.resize(count);
+      for (auto& block : blocks_) {
+        block.data = static_cast<uint8_t*>(aligned_alloc(opt_.block_size));
+        if (!block.data) {
+          close();
+          return AVERROR(ENOMEM);
+        }
+        Block* free_block = &block;
+        if (!free_.push(free_block)) {
+          // queues sized for block_count in the constructor
+          close();
+          return AVERROR_BUG;
+        }
+      }
+
+      uint8_t* buffer = static_cast<uint8_t*>(av_malloc(io_buffer_size));
+      if (!buffer) {
+        close();
+        return AVERROR(ENOMEM);
+      }
+      avio_ = avio_alloc_context(buffer, io_buffer_size, 1, this, nullptr, &AsyncWriter::write_packet, &AsyncWriter::seek);
+      if (!avio_) {
+        av_free(buffer);
+        close();
+        return AVERROR(ENOMEM);
+      }
+
+      running_ = true;
+      thread_ = std::thread(&AsyncWriter::run, this);
+      return 0;
+    }
+
+    // for AVFormatContext::pb (with AVFMT_FLAG_CUSTOM_IO)
+    AVIOContext* avio()
+    {
+      return avio_;
+    }
+
+    // waits until everything written so far is on the file. first write error, or 0.
+    int flush()
+    {
+      if (avio_) {
+        avio_flush(avio_);
+      }
+      submit();
+      while (running_ && free_.size() < blocks_.size() && !error_) {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+      }
+      return error_;
+    }
+
+    // flushes, stops the writer and closes the file. first write error, or 0.
+    int close()
+    {
+      int ret = 0;
+      if (running_) {
+        ret = flush();
+        {
+          std::lock_guard<std::mutex> lock(wake_mutex_);
+          running_ = false;
+        }
+        wake_.notify_one();
+      }
+      if (thread_.joinable()) {
+        thread_.join();
+      }
+
+      if (avio_) {
+        av_freep(&avio_->buffer);
+        av_freep(&avio_);
+      }
+
+      if (fd_ >= 0 && opt_.preallocate > 0) {
+        // drop reserved space past the end
+#if defined(_WIN32)
+        _chsize_s(fd_, size_);
+#else
+        if (ftruncate(fd_, size_) != 0 && !ret) {
+          ret = AVERROR(errno);
+        }
+#endif
+      }
+      close_fd(direct_fd_);
+      close_fd(fd_);
+
+      // writer joined : both queues are ours. no pointer to a freed block
+      // may be handed out by the next open()
+      Block* block = nullptr;
+      while (free_.pop(block)) {
+      }
+      while (filled_.pop(block)) {
+      }
+      for (auto& b : blocks_) {
+        aligned_free(b.data);
+        b.data = nullptr;
+      }
+      blocks_.clear();
+      current_ = nullptr;
+      return ret;
+    }
+
+    // times the muxer waited for a free block
+    uint64_t stalls() const
+    {
+      return stalls_;
+    }
+
+  private:
+    static std::size_t block_count(const Options& options)
+    {
+      std::size_t block_size = std::max<std::size_t>(options.block_size, alignment);
+      return std::max<std::size_t>(2, options.budget / block_size);
+    }
+
+    static void* aligned_alloc(std::size_t size)
+    {
+#if defined(_WIN32)
+      return _aligned_malloc(size, alignment);
+#else
+      void* p = nullptr;
+      return posix_memalign(&p, alignment, size) == 0 ? p : nullptr;
+#endif
+    }
+
+    static void aligned_free(void* p)
+    {
+#if defined(_WIN32)
+      _aligned_free(p);
+#else
+      free(p);
+#endif
+    }
+
+    static void close_fd(int& fd)
+    {
+      if (fd >= 0) {
+#if defined(_WIN32)
+        _close(fd);
+#else
+        ::close(fd);
+#endif
+        fd = -1;
+      }
+    }
+
+    void preallocate(int64_t bytes)
+    {
+      int ret = 0;
+#if defined(_WIN32)
+      ret = _chsize_s(fd_, bytes);
+#elif defined(__linux__)
+      ret = fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, bytes) == 0 ? 0 : errno;
+#else
+      ret = posix_fallocate(fd_, 0, bytes);
+#endif
+      if (ret != 0) {
+        av_log(nullptr, AV_LOG_WARNING, "preallocate %lld bytes failed : %s\n", static_cast<long long>(bytes), filename_.c_str());
+      }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // muxer side (AVIOContext callbacks)
+
+    static int write_packet(void* opaque, uint8_t* buf, int buf_size)
+    {
+      return static_cast<AsyncWriter*>(opaque)->write(buf, buf_size);
+    }
+
+    static int64_t seek(void* opaque, int64_t offset, int whence)
+    {
+      AsyncWriter* self = static_cast<AsyncWriter*>(opaque);
+      if (whence == AVSEEK_SIZE) {
+        return self->size_;
+      }
+      switch (whence & ~AVSEEK_FORCE) {
+      case SEEK_SET: self->pos_ = offset; break;
+      case SEEK_CUR: self->pos_ += offset; break;
+      case SEEK_END: self->pos_ = self->size_ + offset; break;
+      default: return AVERROR(EINVAL);
+      }
+      return self->pos_;
+    }
+
+    int write(const uint8_t* buf, int buf_size)
+    {
+      if (error_) {
+        return error_;
+      }
+
+      std::size_t left = buf_size;
+      while (left > 0) {
+        // after a seek the block can not be continued
+        if (current_ && pos_ != current_->offset + static_cast<int64_t>(current_->size)) {
+          submit();
+        }
+        if (!current_) {
+          current_ = take_block();
+          if (!current_) {
+            return error_ ? static_cast<int>(error_) : AVERROR(EIO);
+          }
+          current_->offset = pos_;
+          current_->size = 0;
+        }
+
+        std::size_t n = std::min(left, opt_.block_size - current_->size);
+        memcpy(current_->data + current_->size, buf, n);
+        current_->size += n;
+        buf += n;
+        left -= n;
+        pos_ += n;
+        size_ = std::max(size_, pos_);
+
+        if (current_->size == opt_.block_size) {
+          submit();
+        }
+      }
+      return buf_size;
+    }
+
+    Block* take_block()
+    {
+      Block* block = nullptr;
+      if (free_.pop(block)) {
+        return block;
+      }
+
+      stalls_++;
+      while (!free_.pop(block)) {
+        if (error_ || !running_) {
+          return nullptr;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+      }
+      return block;
+    }
+
+    void submit()
+    {
+      if (!current_) {
+        return;
+      }
+      if (current_->size == 0) {
+        // nothing to write, back to the free list through the writer
+        current_->offset = -1;
+      }
+      filled_.push(current_);
+      current_ = nullptr;
+
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      wake_.notify_one();
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // writer thread
+
+    void run()
+    {
+      while (true) {
+        Block* block = nullptr;
+        if (filled_.pop(block)) {
+          if (block->offset >= 0 && !error_) {
+            write_block(*block);
+          }
+          free_.push(block);
+          continue;
+        }
+
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        if (!running_ && filled_.empty()) {
+          break;
+        }
+        wake_.wait_for(lock, std::chrono::milliseconds(10), [this]() {
+          return !filled_.empty() || !running_;
+        });
+      }
+    }
+
+    void write_block(const Block& block)
+    {
+      // full blocks at aligned offsets are what O_DIRECT accepts
+      bool aligned = block.offset % alignment == 0 && block.size % alignment == 0;
+      int fd = direct_fd_ >= 0 && aligned ? direct_fd_ : fd_;
+
+      std::size_t done = 0;
+      while (done < block.size) {
+        int64_t ret = write_at(fd, block.data + done, block.size - done, block.offset + done);
+        if (ret < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          error_ = AVERROR(errno);
+          av_log(nullptr, AV_LOG_ERROR, "async write failed : %s\n", filename_.c_str());
+          return;
+        }
+        done += static_cast<std::size_t>(ret);
+      }
+    }
+
+    static int64_t write_at(int fd, const uint8_t* data, std::size_t size, int64_t offset)
+    {
+#if defined(_WIN32)
+      // only this thread touches the file position
+      if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+        return -1;
+      }
+      return _write(fd, data, static_cast<unsigned int>(std::min<std::size_t>(size, 1u << 30)));
+#else
+      return pwrite(fd, data, size, offset);
+#endif
+    }
+  };
+}
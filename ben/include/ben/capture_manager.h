@@ -0,0 +1,285 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "input.h"
+#include "stats.h"
+#include "webcam.h"
+#include "worker_pool.h"
+
+namespace ben {
+
+  struct CameraStatus
+  {
+    int id = -1;
+    std::string name;
+    Priority priority = Priority::Normal;
+    bool failed = false;
+    bool eof = false;
+    std::string error;
+    CaptureStats stats;
+  };
+
+  struct ManagerStats
+  {
+    CaptureStats total; // every camera, percentiles over all samples
+    std::vector<CameraStatus> cameras;
+    std::size_t threads = 0;
+    std::size_t pending = 0;
+    uint64_t tasks = 0;
+    uint64_t steals = 0;
+  };
+
+
+  // runs many Webcams on one WorkerPool instead of a busy caller loop each.
+  // every camera keeps a read thread (blocked on the device most of the time),
+  // decode/filter/encode/mux run as pool tasks, one task per camera at a time.
+  // ex)
+  //   CaptureManager manager;
+  //   std::unique_ptr<Webcam> wc(new Webcam());
+  //   wc->set_view(false);
+  //   int id = manager.add(std::move(wc), std::unique_ptr<Input>(new V4l2Input("/dev/video0")), "cam0.mp4");
+  //   ...
+  //   manager.remove(id);
+  class CaptureManager
+  {
+  private:
+    class Camera : public Task
+    {
+    public:
+      CaptureManager* manager = nullptr;
+      int id = -1;
+      std::string name;
+      std::unique_ptr<Webcam> webcam;
+      std::atomic<Priority> priority{ Priority::Normal };
+
+      // stopping / scheduled / submit are one decision under mutex.
+      // scheduled : in a pool deque or running, from submit to the end of run_camera.
+      std::mutex mutex;
+      bool scheduled = false;
+      bool stopping = false;
+
+      void run() override
+      {
+        manager->run_camera(*this);
+      }
+    };
+
+    std::string last_err_;
+    WorkerPool pool_;
+    std::size_t batch_;
+
+    mutable std::mutex cameras_mutex_;
+    std::map<int, std::unique_ptr<Camera>> cameras_;
+    int next_id_ = 0;
+
+  public:
+    // threads : pool size, 0 = hardware concurrency.
+    // batch : packets a task processes before the camera goes back in line.
+    explicit CaptureManager(std::size_t threads = 0, std::size_t batch = 8)
+      : pool_(threads), batch_(batch ? batch : 1)
+    {
+    }
+
+    ~CaptureManager()
+    {
+      std::vector<int> ids;
+      {
+        std::lock_guard<std::mutex> lock(cameras_mutex_);
+        for (auto& it : cameras_) {
+          ids.push_back(it.first);
+        }
+      }
+      for (int id : ids) {
+        remove(id);
+      }
+    }
+
+    CaptureManager(const CaptureManager&) = delete;
+    CaptureManager& operator=(const CaptureManager&) = delete;
+
+    std::string& last_err()
+    {
+      return last_err_;
+    }
+
+    // starts capturing. webcam is configured by the caller (set_view, stream modes ...),
+    // pipeline mode is turned off. camera id, or -1 (last_err).
+    int add(
+      std::unique_ptr<Webcam> webcam,
+      std::unique_ptr<Input> input,
+      const std::string& output_filename,
+      Priority priority = Priority::Normal,
+      const EncoderConfig& encoder = EncoderConfig()
+    ) {
+      std::unique_ptr<Camera> camera(new Camera());
+      Camera* cam = camera.get();
+      cam->manager = this;
+      cam->name = input ? input->name() : "";
+      cam->priority = priority;
+      cam->webcam = std::move(webcam);
+
+      Webcam& wc = *cam->webcam;
+      wc.pipeline_ = false;
+      wc.managed_ = true;
+      wc.on_packet_ = [this, cam]() {
+        schedule(*cam);
+      };
+
+      if (!wc.start_capture(std::move(input), output_filename, encoder)) {
+        last_err_ = wc.last_err();
+        return -1;
+      }
+
+      std::lock_guard<std::mutex> lock(cameras_mutex_);
+      cam->id = next_id_++;
+      cameras_[cam->id] = std::move(camera);
+      return cam->id;
+    }
+
+    // stops scheduling the camera, then finishes its output (end_capture).
+    // false : unknown id or end_capture failed (last_err)
+    bool remove(int id)
+    {
+      std::unique_ptr<Camera> camera;
+      {
+        std::lock_guard<std::mutex> lock(cameras_mutex_);
+        auto it = cameras_.find(id);
+        if (it == cameras_.end()) {
+          last_err_ = "unknown camera";
+          return false;
+        }
+        camera = std::move(it->second);
+        cameras_.erase(it);
+      }
+
+      // a task already in a deque still runs : wait for it.
+      // no submit after this, the read thread only finds stopping set.
+      {
+        std::lock_guard<std::mutex> lock(camera->mutex);
+        camera->stopping = true;
+      }
+      wait_idle(*camera);
+
+      bool ok = camera->webcam->end_capture();
+      if (!ok) {
+        last_err_ = camera->webcam->last_err();
+      }
+
+      // read thread joined by end_capture : nothing can schedule any more
+      wait_idle(*camera);
+      return ok;
+    }
+
+    void set_priority(int id, Priority priority)
+    {
+      std::lock_guard<std::mutex> lock(cameras_mutex_);
+      auto it = cameras_.find(id);
+      if (it != cameras_.end()) {
+        it->second->priority = priority;
+      }
+    }
+
+    // false once the camera failed or its input ended (see status)
+    bool capturing(int id) const
+    {
+      std::lock_guard<std::mutex> lock(cameras_mutex_);
+      auto it = cameras_.find(id);
+      if (it == cameras_.end()) {
+        return false;
+      }
+      const Webcam& wc = *it->second->webcam;
+      return !wc.failed_ && !wc.eof_;
+    }
+
+    ManagerStats stats() const
+    {
+      ManagerStats s;
+      s.threads = pool_.size();
+      s.pending = pool_.pending();
+      s.tasks = pool_.executed();
+      s.steals = pool_.steals();
+
+      // about 15KB of counters
+      std::unique_ptr<StatsCollector> total(new StatsCollector());
+
+      std::lock_guard<std::mutex> lock(cameras_mutex_);
+      for (auto& it : cameras_) {
+        Camera& camera = *it.second;
+        Webcam& wc = *camera.webcam;
+
+        CameraStatus status;
+        status.id = camera.id;
+        status.name = camera.name;
+        status.priority = camera.priority;
+        status.failed = wc.failed_;
+        status.eof = wc.eof_;
+        if (status.failed) {
+          std::lock_guard<std::mutex> err_lock(wc.err_mutex_);
+          status.error = wc.pipeline_err_;
+        }
+        status.stats = wc.stats();
+        s.cameras.push_back(status);
+
+        wc.stats_.add_to(*total);
+      }
+      s.total = total->snapshot();
+      return s;
+    }
+
+  private:
+    // read thread of the camera, or a worker finishing a batch
+    void schedule(Camera& camera)
+    {
+      std::lock_guard<std::mutex> lock(camera.mutex);
+      if (camera.stopping || camera.scheduled) {
+        return;
+      }
+      camera.scheduled = true;
+      pool_.submit(&camera, camera.priority);
+    }
+
+    // camera stays alive until scheduled is cleared : the last thing done here
+    void run_camera(Camera& camera)
+    {
+      bool stopping = false;
+      {
+        std::lock_guard<std::mutex> lock(camera.mutex);
+        stopping = camera.stopping;
+      }
+      if (!stopping) {
+        camera.webcam->process(batch_);
+      }
+
+      // packets left (or came in while the flag was set) : back in line,
+      // behind the other cameras of the same priority. checked under the lock,
+      // a packet pushed after it finds scheduled cleared and submits itself.
+      std::lock_guard<std::mutex> lock(camera.mutex);
+      if (!camera.stopping && camera.webcam->pending()) {
+        pool_.submit(&camera, camera.priority);
+        return;
+      }
+      camera.scheduled = false;
+    }
+
+    // no task of the camera queued or running
+    static void wait_idle(Camera& camera)
+    {
+      while (true) {
+        {
+          std::lock_guard<std::mutex> lock(camera.mutex);
+          if (!camera.scheduled) {
+            return;
+          }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  };
+}
@@ -0,0 +1,409 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+  #include <immintrin.h>
+  #define BEN_COLOR_X86
+  #if defined(__GNUC__)
+    // instruction set per function : the build stays baseline, cpu() picks at run time
+    #define BEN_COLOR_TARGET(isa) __attribute__((target(isa)))
+  #else
+    #define BEN_COLOR_TARGET(isa)
+  #endif
+#endif
+
+#include "ffmpeg.h"
+
+namespace ben {
+
+  // conversion paths, slowest first
+  enum class ColorCpu
+  {
+    Scalar,
+    SSE4,
+    AVX2
+  };
+
+  // same size yuv -> bgr24 (opencv order) for the viewer and frame taps.
+  // yuv420p, yuv422p (and yuvj), nv12, yuyv422. bt.709 when the frame says so, bt.601
+  // otherwise. limited or full range from the frame (color_range, yuvj).
+  // chroma is the nearest sample, not interpolated (like swscale's unscaled path).
+  // 16 bit fixed point : every path gives the same bytes.
+  class YuvToBgr
+  {
+  private:
+    enum class Layout
+    {
+      Planar, // y, u, v planes
+      Nv12,   // y plane, interleaved uv plane
+      Yuyv    // packed y0 u y1 v
+    };
+
+    // inputs are (y - offset) << 7 and (c - 128) << 8. products (rounded high half
+    // of 16x16 bits) come out 64 times the pixel value.
+    struct Coeffs
+    {
+      int16_t y_offset;
+      int16_t y;
+      int16_t rv;
+      int16_t gu;
+      int16_t gv;
+      int16_t bu;
+    };
+
+    typedef void (*Row)(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int width, const Coeffs& k);
+
+  public:
+    static bool supported(AVPixelFormat format)
+    {
+      switch (format) {
+      case AV_PIX_FMT_YUV420P:
+      case AV_PIX_FMT_YUVJ420P:
+      case AV_PIX_FMT_YUV422P:
+      case AV_PIX_FMT_YUVJ422P:
+      case AV_PIX_FMT_NV12:
+      case AV_PIX_FMT_YUYV422:
+        return true;
+      default:
+        return false;
+      }
+    }
+
+    // best path of this cpu, looked up once
+    static ColorCpu cpu()
+    {
+      static const ColorCpu best = detect();
+      return best;
+    }
+
+    // false : format not supported. dst : width * 3 bytes per row
+    static bool convert(const AVFrame* frame, uint8_t* dst, int dst_linesize)
+    {
+      return convert(frame, dst, dst_linesize, cpu());
+    }
+
+    // a given path (bench), rows [row_begin, row_end) only (slices, -1 : to the bottom).
+    // paths this cpu lacks fall back to the best it has.
+    static bool convert(
+      const AVFrame* frame,
+      uint8_t* dst,
+      int dst_linesize,
+      ColorCpu path,
+      int row_begin = 0,
+      int row_end = -1
+    ) {
+      AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+      if (static_cast<int>(path) > static_cast<int>(cpu())) {
+        path = cpu();
+      }
+
+      Row row = nullptr;
+      int chroma_shift = 0;
+      switch (format) {
+      case AV_PIX_FMT_YUV420P:
+      case AV_PIX_FMT_YUVJ420P:
+        row = pick<Layout::Planar>(path);
+        chroma_shift = 1;
+        break;
+      case AV_PIX_FMT_YUV422P:
+      case AV_PIX_FMT_YUVJ422P:
+        row = pick<Layout::Planar>(path);
+        break;
+      case AV_PIX_FMT_NV12:
+        row = pick<Layout::Nv12>(path);
+        chroma_shift = 1;
+        break;
+      case AV_PIX_FMT_YUYV422:
+        row = pick<Layout::Yuyv>(path);
+        break;
+      default:
+        return false;
+      }
+
+      Coeffs k = coeffs(
+        ff::PixFmt::is_full(format, frame->color_range),
+        frame->colorspace == AVCOL_SPC_BT709
+      );
+
+      if (row_end < 0 || row_end > frame->height) {
+        row_end = frame->height;
+      }
+      for (int i = row_begin; i < row_end; i++) {
+        int c = i >> chroma_shift;
+        const uint8_t* y = frame->data[0] + static_cast<std::ptrdiff_t>(i) * frame->linesize[0];
+        const uint8_t* u = frame->data[1] ? frame->data[1] + static_cast<std::ptrdiff_t>(c) * frame->linesize[1] : nullptr;
+        const uint8_t* v = frame->data[2] ? frame->data[2] + static_cast<std::ptrdiff_t>(c) * frame->linesize[2] : nullptr;
+        row(y, u, v, dst + static_cast<std::ptrdiff_t>(i) * dst_linesize, frame->width, k);
+      }
+      return true;
+    }
+
+  private:
+    static ColorCpu detect()
+    {
+#if defined(BEN_COLOR_X86)
+      int flags = av_get_cpu_flags();
+      if (flags & AV_CPU_FLAG_AVX2) {
+        return ColorCpu::AVX2;
+      }
+      if (flags & AV_CPU_FLAG_SSE4) {
+        return ColorCpu::SSE4;
+      }
+#endif
+      return ColorCpu::Scalar;
+    }
+
+    static Coeffs coeffs(bool full, bool bt709)
+    {
+      double kr = bt709 ? 0.2126 : 0.299;
+      double kb = bt709 ? 0.0722 : 0.114;
+      double kg = 1.0 - kr - kb;
+      double y_scale = full ? 1.0 : 255.0 / 219.0;
+      double c_scale = full ? 1.0 : 255.0 / 224.0;
+
+      Coeffs k;
+      k.y_offset = full ? 0 : 16;
+      k.y = fixed(y_scale * 16384);
+      k.rv = fixed(2 * (1 - kr) * c_scale * 8192);
+      k.gu = fixed(-2 * (1 - kb) * kb / kg * c_scale * 8192);
+      k.gv = fixed(-2 * (1 - kr) * kr / kg * c_scale * 8192);
+      k.bu = fixed(2 * (1 - kb) * c_scale * 8192);
+      return k;
+    }
+
+    static int16_t fixed(double v)
+    {
+      return static_cast<int16_t>(v < 0 ? v - 0.5 : v + 0.5);
+    }
+
+    template <Layout L>
+    static Row pick(ColorCpu path)
+    {
+#if defined(BEN_COLOR_X86)
+      switch (path) {
+      case ColorCpu::AVX2:
+        return &row_avx2<L>;
+      case ColorCpu::SSE4:
+        return &row_sse4<L>;
+      default:
+        break;
+      }
+#endif
+      return &row_c<L>;
+    }
+
+    // scalar model of the simd lanes : pmulhrsw, saturating adds, packuswb
+    static int mulhrs(int a, int b)
+    {
+      return (a * b + 0x4000) >> 15;
+    }
+
+    static int sat(int v)
+    {
+      return v < -32768 ? -32768 : (v > 32767 ? 32767 : v);
+    }
+
+    static uint8_t pack(int v)
+    {
+      v = sat(v + 32) >> 6;
+      return static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+    }
+
+    static void pixel(int y, int u, int v, uint8_t* dst, const Coeffs& k)
+    {
+      int ys = (y - k.y_offset) * 128;
+      int us = (u - 128) * 256;
+      int vs = (v - 128) * 256;
+      int yt = mulhrs(ys, k.y);
+      dst[0] = pack(sat(yt + mulhrs(us, k.bu)));
+      dst[1] = pack(sat(sat(yt + mulhrs(us, k.gu)) + mulhrs(vs, k.gv)));
+      dst[2] = pack(sat(yt + mulhrs(vs, k.rv)));
+    }
+
+    // pixels x .. width of a row
+    template <Layout L>
+    static void row_tail(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int x, int width, const Coeffs& k)
+    {
+      for (; x < width; x++) {
+        int c = x >> 1;
+        switch (L) {
+        case Layout::Planar:
+          pixel(y[x], u[c], v[c], dst + x * 3, k);
+          break;
+        case Layout::Nv12:
+          pixel(y[x], u[c * 2], u[c * 2 + 1], dst + x * 3, k);
+          break;
+        case Layout::Yuyv:
+          pixel(y[x * 2], y[c * 4 + 1], y[c * 4 + 3], dst + x * 3, k);
+          break;
+        }
+      }
+    }
+
+    template <Layout L>
+    static void row_c(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int width, const Coeffs& k)
+    {
+      row_tail<L>(y, u, v, dst, 0, width, k);
+    }
+
+#if defined(BEN_COLOR_X86)
+    // 16 pixels of y, u, v as bytes (chroma repeated per pixel)
+    template <Layout L>
+    BEN_COLOR_TARGET("sse4.1")
+    static void load16(const uint8_t* y, const uint8_t* u, const uint8_t* v, int x, __m128i& yy, __m128i& uu, __m128i& vv)
+    {
+      switch (L) {
+      case Layout::Planar: {
+        yy = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x));
+        __m128i u8 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(u + x / 2));
+        __m128i v8 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(v + x / 2));
+        uu = _mm_unpacklo_epi8(u8, u8);
+        vv = _mm_unpacklo_epi8(v8, v8);
+        break;
+      }
+      case Layout::Nv12: {
+        yy = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x));
+        __m128i uv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(u + x));
+        uu = _mm_shuffle_epi8(uv, _mm_setr_epi8(0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14));
+        vv = _mm_shuffle_epi8(uv, _mm_setr_epi8(1, 1, 3, 3, 5, 5, 7, 7, 9, 9, 11, 11, 13, 13, 15, 15));
+        break;
+      }
+      case Layout::Yuyv: {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x * 2));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x * 2 + 16));
+        __m128i ys = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+        __m128i us = _mm_setr_epi8(1, 1, 5, 5, 9, 9, 13, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+        __m128i vs = _mm_setr_epi8(3, 3, 7, 7, 11, 11, 15, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+        yy = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, ys), _mm_shuffle_epi8(b, ys));
+        uu = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, us), _mm_shuffle_epi8(b, us));
+        vv = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, vs), _mm_shuffle_epi8(b, vs));
+        break;
+      }
+      }
+    }
+
+    // 48 bytes b g r b g r ...
+    BEN_COLOR_TARGET("sse4.1")
+    static void store16(uint8_t* dst, __m128i b, __m128i g, __m128i r)
+    {
+      __m128i o0 = _mm_or_si128(
+        _mm_or_si128(
+          _mm_shuffle_epi8(b, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+          _mm_shuffle_epi8(g, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))
+        ),
+        _mm_shuffle_epi8(r, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1))
+      );
+      __m128i o1 = _mm_or_si128(
+        _mm_or_si128(
+          _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+          _mm_shuffle_epi8(g, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))
+        ),
+        _mm_shuffle_epi8(r, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1))
+      );
+      __m128i o2 = _mm_or_si128(
+        _mm_or_si128(
+          _mm_shuffle_epi8(b, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+          _mm_shuffle_epi8(g, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))
+        ),
+        _mm_shuffle_epi8(r, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15))
+      );
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), o0);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16), o1);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 32), o2);
+    }
+
+    // 8 pixels, 16 bit lanes. results still 64 times the pixel value.
+    BEN_COLOR_TARGET("sse4.1")
+    static void bgr8_sse4(__m128i y, __m128i u, __m128i v, const Coeffs& k, __m128i& b, __m128i& g, __m128i& r)
+    {
+      __m128i ys = _mm_slli_epi16(_mm_sub_epi16(y, _mm_set1_epi16(k.y_offset)), 7);
+      __m128i us = _mm_slli_epi16(_mm_sub_epi16(u, _mm_set1_epi16(128)), 8);
+      __m128i vs = _mm_slli_epi16(_mm_sub_epi16(v, _mm_set1_epi16(128)), 8);
+      __m128i yt = _mm_mulhrs_epi16(ys, _mm_set1_epi16(k.y));
+      __m128i round = _mm_set1_epi16(32);
+
+      b = _mm_adds_epi16(yt, _mm_mulhrs_epi16(us, _mm_set1_epi16(k.bu)));
+      g = _mm_adds_epi16(
+        _mm_adds_epi16(yt, _mm_mulhrs_epi16(us, _mm_set1_epi16(k.gu))),
+        _mm_mulhrs_epi16(vs, _mm_set1_epi16(k.gv))
+      );
+      r = _mm_adds_epi16(yt, _mm_mulhrs_epi16(vs, _mm_set1_epi16(k.rv)));
+
+      b = _mm_srai_epi16(_mm_adds_epi16(b, round), 6);
+      g = _mm_srai_epi16(_mm_adds_epi16(g, round), 6);
+      r = _mm_srai_epi16(_mm_adds_epi16(r, round), 6);
+    }
+
+    template <Layout L>
+    BEN_COLOR_TARGET("sse4.1")
+    static void row_sse4(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int width, const Coeffs& k)
+    {
+      int x = 0;
+      for (; x + 16 <= width; x += 16) {
+        __m128i yy, uu, vv;
+        load16<L>(y, u, v, x, yy, uu, vv);
+
+        __m128i b0, g0, r0, b1, g1, r1;
+        bgr8_sse4(_mm_cvtepu8_epi16(yy), _mm_cvtepu8_epi16(uu), _mm_cvtepu8_epi16(vv), k, b0, g0, r0);
+        bgr8_sse4(
+          _mm_cvtepu8_epi16(_mm_srli_si128(yy, 8)),
+          _mm_cvtepu8_epi16(_mm_srli_si128(uu, 8)),
+          _mm_cvtepu8_epi16(_mm_srli_si128(vv, 8)),
+          k, b1, g1, r1
+        );
+        store16(dst + x * 3, _mm_packus_epi16(b0, b1), _mm_packus_epi16(g0, g1), _mm_packus_epi16(r0, r1));
+      }
+      row_tail<L>(y, u, v, dst, x, width, k);
+    }
+
+    // 16 pixels in one register : same math as bgr8_sse4
+    BEN_COLOR_TARGET("avx2")
+    static __m128i pack16(__m256i v)
+    {
+      return _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    }
+
+    template <Layout L>
+    BEN_COLOR_TARGET("avx2")
+    static void row_avx2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, int width, const Coeffs& k)
+    {
+      __m256i y_offset = _mm256_set1_epi16(k.y_offset);
+      __m256i c_offset = _mm256_set1_epi16(128);
+      __m256i ky = _mm256_set1_epi16(k.y);
+      __m256i krv = _mm256_set1_epi16(k.rv);
+      __m256i kgu = _mm256_set1_epi16(k.gu);
+      __m256i kgv = _mm256_set1_epi16(k.gv);
+      __m256i kbu = _mm256_set1_epi16(k.bu);
+      __m256i round = _mm256_set1_epi16(32);
+
+      int x = 0;
+      for (; x + 16 <= width; x += 16) {
+        __m128i yy, uu, vv;
+        load16<L>(y, u, v, x, yy, uu, vv);
+
+        __m256i ys = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(yy), y_offset), 7);
+        __m256i us = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(uu), c_offset), 8);
+        __m256i vs = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(vv), c_offset), 8);
+        __m256i yt = _mm256_mulhrs_epi16(ys, ky);
+
+        __m256i b = _mm256_adds_epi16(yt, _mm256_mulhrs_epi16(us, kbu));
+        __m256i g = _mm256_adds_epi16(
+          _mm256_adds_epi16(yt, _mm256_mulhrs_epi16(us, kgu)),
+          _mm256_mulhrs_epi16(vs, kgv)
+        );
+        __m256i r = _mm256_adds_epi16(yt, _mm256_mulhrs_epi16(vs, krv));
+
+        store16(
+          dst + x * 3,
+          pack16(_mm256_srai_epi16(_mm256_adds_epi16(b, round), 6)),
+          pack16(_mm256_srai_epi16(_mm256_adds_epi16(g, round), 6)),
+          pack16(_mm256_srai_epi16(_mm256_adds_epi16(r, round), 6))
+        );
+      }
+      row_tail<L>(y, u, v, dst, x, width, k);
+    }
+#endif
+  };
+}
@@ -0,0 +1,251 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ffmpeg.h"
+
+namespace ben {
+
+  // decoder threading for Webcam::set_decoder.
+  // unset fields (0) are picked from the frame size, the decoder and the core count.
+  struct DecoderConfig
+  {
+    int thread_count = 0;                    // 0 : auto, 1 : no threads
+    int thread_type = 0;                     // FF_THREAD_FRAME and/or FF_THREAD_SLICE
+  };
+
+
+  // frame threads for intra only decoders libavcodec has none for (mjpeg) :
+  // every packet decodes alone, so each context takes every n-th packet.
+  // frames come out in packet order, up to count - 1 frames late like
+  // libavcodec frame threads. send/receive work like avcodec_send_packet/receive_frame.
+  class ParallelDecoder : public ff::Util
+  {
+  private:
+    struct Slot
+    {
+      AVCodecContext* ctx = nullptr;
+      ff::Packet packet;
+      ff::Frame frame;
+      int ret = 0;
+      bool queued = false; // packet handed to the worker
+      bool done = false;   // ret (and frame) ready
+      std::condition_variable cv;
+      std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Slot>> slots_;
+    std::mutex mutex_;
+    std::condition_variable done_cv_;
+    std::size_t head_ = 0;      // oldest slot in flight
+    std::size_t in_flight_ = 0;
+    bool draining_ = false;
+    bool stop_ = false;
+
+  public:
+    // count contexts opened from the stream parameters, timing of dec_ctx
+    ParallelDecoder(const AVCodec* dec, const AVCodecParameters* par, const AVCodecContext* dec_ctx, int count)
+    {
+      try {
+        for (int i = 0; i < count; i++) {
+          std::unique_ptr<Slot> slot(new Slot());
+          slot->ctx = avcodec_alloc_context3(dec);
+          chk(slot->ctx, "parallel decoder avcodec_alloc_context3");
+          slots_.push_back(std::move(slot));
+
+          AVCodecContext* ctx = slots_.back()->ctx;
+          chk(avcodec_parameters_to_context(ctx, par), "parallel decoder avcodec_parameters_to_context");
+          ctx->time_base = dec_ctx->time_base;
+          ctx->pkt_timebase = dec_ctx->pkt_timebase;
+          ctx->framerate = dec_ctx->framerate;
+          ctx->thread_count = 1;
+          chk(avcodec_open2(ctx, dec, NULL), "parallel decoder avcodec_open2 : %s", dec->name);
+        }
+      } catch (std::runtime_error&) {
+        close();
+        throw;
+      }
+
+      for (auto& slot : slots_) {
+        slot->thread = std::thread(&ParallelDecoder::work, this, slot.get());
+      }
+    }
+
+    ~ParallelDecoder()
+    {
+      close();
+    }
+
+    ParallelDecoder(const ParallelDecoder&) = delete;
+    ParallelDecoder& operator=(const ParallelDecoder&) = delete;
+
+    std::size_t size() const
+    {
+      return slots_.size();
+    }
+
+    // packet == nullptr : drain, receive_frame gives the rest then AVERROR_EOF
+    int send_packet(const AVPacket* packet)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (draining_) {
+        return AVERROR_EOF;
+      }
+      if (!packet) {
+        draining_ = true;
+        return 0;
+      }
+      if (in_flight_ == slots_.size()) {
+        return AVERROR(EAGAIN);
+      }
+
+      Slot& slot = *slots_[(head_ + in_flight_) % slots_.size()];
+      int ret = av_packet_ref(slot.packet, packet);
+      if (ret < 0) {
+        return ret;
+      }
+      slot.queued = true;
+      slot.done = false;
+      in_flight_++;
+      slot.cv.notify_one();
+      return 0;
+    }
+
+    // the oldest frame. waits only when every worker is busy or while draining.
+    int receive_frame(AVFrame* frame)
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (in_flight_ > 0) {
+        Slot& slot = *slots_[head_];
+        if (!slot.done) {
+          if (!draining_ && in_flight_ < slots_.size()) {
+            // a free worker : more input first
+            return AVERROR(EAGAIN);
+          }
+          done_cv_.wait(lock, [&]() { return slot.done; });
+        }
+
+        int ret = slot.ret;
+        if (ret >= 0) {
+          av_frame_move_ref(frame, slot.frame);
+        }
+        slot.done = false;
+        head_ = (head_ + 1) % slots_.size();
+        in_flight_--;
+
+        if (ret != AVERROR(EAGAIN)) {
+          return ret;
+        }
+        // no frame out of that packet
+      }
+      return draining_ ? AVERROR_EOF : AVERROR(EAGAIN);
+    }
+
+  private:
+    void work(Slot* slot)
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (true) {
+        slot->cv.wait(lock, [&]() { return slot->queued || stop_; });
+        if (stop_) {
+          return;
+        }
+        slot->queued = false;
+
+        lock.unlock();
+        int ret = avcodec_send_packet(slot->ctx, slot->packet);
+        if (ret >= 0) {
+          ret = avcodec_receive_frame(slot->ctx, slot->frame);
+        }
+        slot->packet.unref();
+        lock.lock();
+
+        slot->ret = ret;
+        slot->done = true;
+        done_cv_.notify_one();
+      }
+    }
+
+    void close()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      for (auto& slot : slots_) {
+        slot->cv.notify_one();
+        if (slot->thread.joinable()) {
+          slot->thread.join();
+        }
+        avcodec_free_context(&slot->ctx);
+      }
+      slots_.clear();
+    }
+  };
+
+
+  class DecoderSetup
+  {
+  public:
+    // sets the libavcodec threading of dec_ctx (before avcodec_open2).
+    // returns the ParallelDecoder size for frame threads the decoder lacks, 0 : none.
+    static int apply(const DecoderConfig& config, const AVCodec* dec, AVCodecContext* dec_ctx)
+    {
+      if (dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO) {
+        // audio decodes in microseconds
+        dec_ctx->thread_count = config.thread_count ? config.thread_count : 1;
+        return 0;
+      }
+
+      int cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+      int64_t pixels = static_cast<int64_t>(dec_ctx->width) * dec_ctx->height;
+
+      int count = config.thread_count;
+      if (count <= 0) {
+        // small frames decode fast enough alone. more threads than the frame
+        // size needs only add frame delay (frame threads).
+        if (pixels <= 640 * 480) {
+          count = 1;
+        } else if (pixels <= 1920 * 1080) {
+          count = 4;
+        } else {
+          count = 8;
+        }
+        count = std::min(count, cores);
+      }
+      if (count <= 1) {
+        dec_ctx->thread_count = 1;
+        return 0;
+      }
+
+      bool frame_caps = (dec->capabilities & AV_CODEC_CAP_FRAME_THREADS) != 0;
+      bool slice_caps = (dec->capabilities & AV_CODEC_CAP_SLICE_THREADS) != 0;
+      const AVCodecDescriptor* desc = avcodec_descriptor_get(dec->id);
+      bool intra_only = desc && (desc->props & AV_CODEC_PROP_INTRA_ONLY);
+
+      int type = config.thread_type;
+      if (!type) {
+        // camera h264 is mostly one slice per frame : frame threads do the work
+        type = frame_caps || intra_only ? FF_THREAD_FRAME | FF_THREAD_SLICE : FF_THREAD_SLICE;
+      }
+
+      if ((type & FF_THREAD_FRAME) && !frame_caps && intra_only) {
+        dec_ctx->thread_count = 1;
+        return count;
+      }
+      if (!frame_caps && !slice_caps) {
+        // single threaded decoder
+        dec_ctx->thread_count = 1;
+        return 0;
+      }
+
+      dec_ctx->thread_count = count;
+      dec_ctx->thread_type = type;
+      return 0;
+    }
+  };
+}
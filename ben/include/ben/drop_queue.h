@@ -0,0 +1,114 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace ben {
+
+  // bounded lock-free queue for one producer and two consumers : the consumer
+  // thread, and the producer itself taking the oldest item out when the queue is
+  // full (drop oldest without waiting for the consumer).
+  // every slot has a sequence number (bounded mpmc queue by D. Vyukov) : a slot
+  // claimed by one consumer and still being moved out is never written or taken
+  // by anybody else. capacity is rounded up to a power of two.
+  template <typename T>
+  class DropQueue
+  {
+  private:
+    static const std::size_t cache_line = 64;
+
+    struct Slot
+    {
+      std::atomic<std::size_t> seq;
+      T item;
+    };
+
+    std::vector<Slot> ring_;
+    std::size_t mask_ = 0;
+
+    char pad0_[cache_line];
+    std::atomic<std::size_t> head_;
+    char pad1_[cache_line - sizeof(std::atomic<std::size_t>)];
+    std::atomic<std::size_t> tail_;
+    char pad2_[cache_line - sizeof(std::atomic<std::size_t>)];
+
+  public:
+    explicit DropQueue(std::size_t capacity = 64)
+      : head_(0), tail_(0)
+    {
+      std::size_t size = 2;
+      while (size < capacity) {
+        size <<= 1;
+      }
+      ring_ = std::vector<Slot>(size);
+      mask_ = size - 1;
+      for (std::size_t i = 0; i < size; i++) {
+        ring_[i].seq.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    DropQueue(const DropQueue&) = delete;
+    DropQueue& operator=(const DropQueue&) = delete;
+
+    // producer only. fill(T& slot) writes the slot in place.
+    // false : full, or the oldest slot is still being moved out by a consumer.
+    template <typename Fill>
+    bool push_with(Fill fill)
+    {
+      std::size_t tail = tail_.load(std::memory_order_relaxed);
+      Slot& slot = ring_[tail & mask_];
+      if (slot.seq.load(std::memory_order_acquire) != tail) {
+        return false;
+      }
+      fill(slot.item);
+      slot.seq.store(tail + 1, std::memory_order_release);
+      tail_.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    // consumer, or the producer dropping the oldest. slot is moved into item.
+    bool pop(T& item)
+    {
+      std::size_t head = head_.load(std::memory_order_relaxed);
+      while (true) {
+        Slot& slot = ring_[head & mask_];
+        std::size_t seq = slot.seq.load(std::memory_order_acquire);
+        std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(head + 1);
+        if (diff < 0) {
+          return false;
+        }
+        if (diff > 0) {
+          // the other consumer took it
+          head = head_.load(std::memory_order_relaxed);
+          continue;
+        }
+        if (head_.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) {
+          item = std::move(slot.item);
+          // free for the producer one lap later
+          slot.seq.store(head + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      }
+    }
+
+    std::size_t size() const
+    {
+      std::size_t tail = tail_.load(std::memory_order_acquire);
+      std::size_t head = head_.load(std::memory_order_acquire);
+      return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const
+    {
+      return size() == 0;
+    }
+
+    std::size_t capacity() const
+    {
+      return mask_ + 1;
+    }
+  };
+}
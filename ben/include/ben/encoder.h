@@ -0,0 +1,140 @@
+﻿#pragma once
+
+#include <cmath>
+#include <map>
+#include <string>
+#include "ffmpeg.h"
+
+namespace ben {
+
+  // what the encoder defaults favor
+  enum class EncoderTuning
+  {
+    LowLatency, // zerolatency, no b-frames, slice threads, 1s gop : no frame delay
+    Throughput  // b-frames, frame threads, 2s gop : better compression, a few frames of delay
+  };
+
+  // video encoder settings for Webcam::start_capture.
+  // unset fields (empty, -1, 0) take the tuning default for the codec.
+  struct EncoderConfig
+  {
+    AVCodecID codec_id = AV_CODEC_ID_NONE;   // NONE : capture codec (copied under StreamMode::Auto)
+    std::string encoder;                     // by name ("libx264", "libx265", "h264_nvenc"), wins over codec_id
+    EncoderTuning tuning = EncoderTuning::LowLatency;
+    std::string preset;                      // x264/x265 : "ultrafast" ... "veryslow"
+    std::string tune;                        // x264/x265 : "zerolatency", "film" ...
+    int crf = -1;                            // x264/x265 constant quality, used when bit_rate is 0
+    int64_t bit_rate = 0;
+    int gop_size = -1;                       // frames between keyframes
+    int max_b_frames = -1;                   // -1 : tuning default where the encoder has b-frames
+    int thread_count = 0;                    // 0 : one per core
+    int thread_type = 0;                     // FF_THREAD_FRAME and/or FF_THREAD_SLICE
+    std::map<std::string, std::string> options; // other encoder private options ("x264-params" ...)
+  };
+
+
+  class EncoderSetup : public ff::Util
+  {
+  public:
+    // encoder named by config, nullptr : none asked for
+    static AVCodec* find(const EncoderConfig& config)
+    {
+      AVCodec* enc = nullptr;
+      if (!config.encoder.empty()) {
+        enc = avcodec_find_encoder_by_name(config.encoder.c_str());
+        chk(enc, "encoder not found : %s", config.encoder.c_str());
+      } else if (config.codec_id != AV_CODEC_ID_NONE) {
+        enc = avcodec_find_encoder(config.codec_id);
+        chk(enc, "encoder not found : %s", avcodec_get_name(config.codec_id));
+      }
+      return enc;
+    }
+
+    // encoders the tuning gives b-frames to
+    static bool b_frames(const AVCodec* enc)
+    {
+      return
+        !strcmp(enc->name, "libx264") ||
+        !strcmp(enc->name, "libx264rgb") ||
+        !strcmp(enc->name, "libx265") ||
+        enc->id == AV_CODEC_ID_MPEG2VIDEO ||
+        enc->id == AV_CODEC_ID_MPEG4;
+    }
+
+    // fills enc_ctx and the avcodec_open2 options. enc_ctx->time_base must be set.
+    static void apply(const EncoderConfig& config, const AVCodec* enc, AVCodecContext* enc_ctx, AVDictionary** options)
+    {
+      bool low_latency = config.tuning == EncoderTuning::LowLatency;
+      bool x264 = !strcmp(enc->name, "libx264") || !strcmp(enc->name, "libx264rgb");
+      bool x265 = !strcmp(enc->name, "libx265");
+
+      // frames per second from the time base (1/fps)
+      double fps = enc_ctx->time_base.num > 0 && enc_ctx->time_base.den > 0 ? av_q2d(av_inv_q(enc_ctx->time_base)) : 30.0;
+      int gop = config.gop_size;
+      if (gop < 0) {
+        gop = static_cast<int>(std::lround(fps * (low_latency ? 1 : 2)));
+      }
+      if (gop > 0) {
+        enc_ctx->gop_size = gop;
+      }
+
+      // mjpeg, h263 ... (no b-frames) fail avcodec_open2 with max_b_frames set :
+      // other encoders keep the codec default unless asked for
+      if (config.max_b_frames >= 0) {
+        enc_ctx->max_b_frames = config.max_b_frames;
+      } else if (b_frames(enc)) {
+        enc_ctx->max_b_frames = low_latency ? 0 : 3;
+      }
+
+      if (config.bit_rate > 0) {
+        enc_ctx->bit_rate = config.bit_rate;
+      }
+
+      // frame threads delay output by a frame per thread
+      enc_ctx->thread_count = config.thread_count;
+      if (config.thread_type) {
+        enc_ctx->thread_type = config.thread_type;
+      } else {
+        enc_ctx->thread_type = low_latency ? FF_THREAD_SLICE : FF_THREAD_FRAME | FF_THREAD_SLICE;
+      }
+
+      std::string preset = config.preset;
+      std::string tune = config.tune;
+      int crf = config.crf;
+      if (x264 || x265) {
+        if (preset.empty()) {
+          // x265 is about 4x slower than x264 at the same preset
+          preset = low_latency ? (x264 ? "veryfast" : "ultrafast") : (x264 ? "medium" : "fast");
+        }
+        if (tune.empty() && low_latency) {
+          tune = "zerolatency";
+        }
+        if (crf < 0 && config.bit_rate <= 0) {
+          crf = x264 ? 23 : 28;
+        }
+      }
+
+      if (!preset.empty()) {
+        av_dict_set(options, "preset", preset.c_str(), 0);
+      }
+      if (!tune.empty()) {
+        av_dict_set(options, "tune", tune.c_str(), 0);
+      }
+      if (crf >= 0) {
+        av_dict_set_int(options, "crf", crf, 0);
+      }
+      for (auto& it : config.options) {
+        av_dict_set(options, it.first.c_str(), it.second.c_str(), 0);
+      }
+    }
+
+    // avcodec_open2 leaves the options it did not take
+    static void report_unused(const AVDictionary* options, const AVCodec* enc)
+    {
+      AVDictionaryEntry* entry = nullptr;
+      while ((entry = av_dict_get(options, "", entry, AV_DICT_IGNORE_SUFFIX))) {
+        av_log(nullptr, AV_LOG_WARNING, "%s : option not used %s=%s\n", enc->name, entry->key, entry->value);
+      }
+    }
+  };
+}
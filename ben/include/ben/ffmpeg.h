@@ -1,8 +1,19 @@
 ﻿#pragma once
 
-#include <conio.h>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
 #include <stdexcept>
 
+#if defined(_WIN32)
+  #include <conio.h>
+#else
+  #include <sys/select.h>
+  #include <termios.h>
+  #include <unistd.h>
+#endif
+
 extern "C" {
   #include <libavcodec/avcodec.h>
   #pragma comment (lib, "avcodec.lib")
@@ -17,6 +28,8 @@ extern "C" {
   #pragma comment (lib, "avformat.lib")
 
   #include <libavutil/avutil.h>
+  #include <libavutil/buffer.h>
+  #include <libavutil/cpu.h>
   #include <libavutil/imgutils.h>
   #pragma comment (lib, "avutil.lib")
 
@@ -44,6 +57,7 @@ namespace ben {
     public:
       AVCodecContext* dec_ = nullptr;
       AVCodecContext* enc_ = nullptr;
+      bool copy_ = false; // remux packets as they are, enc_ is not used
     };
 
     class FilteringContext
@@ -54,6 +68,84 @@ namespace ben {
       AVFilterGraph* filter_graph;
     };
 
+#if defined(_DEBUG)
+    // ff::Frame shells and BufferPool buffers, nothing else : not a heap count.
+    // the loop still allocates per frame inside ffmpeg (buffersrc frame shells,
+    // av_packet_ref / av_frame_ref buffer refs for sinks and subscribers).
+    // shows that the pools stopped growing after warm-up.
+    class FrameAllocCounter
+    {
+    public:
+      static std::atomic<uint64_t>& value()
+      {
+        static std::atomic<uint64_t> count(0);
+        return count;
+      }
+
+      static void add()
+      {
+        value()++;
+      }
+
+      static uint64_t count()
+      {
+        return value().load();
+      }
+    };
+  #define BEN_COUNT_FRAME_ALLOC() ben::ff::FrameAllocCounter::add()
+#else
+  #define BEN_COUNT_FRAME_ALLOC()
+#endif
+
+    // AVBufferPool of fixed size buffers. reinitialized when a bigger size is asked.
+    class BufferPool
+    {
+    private:
+      AVBufferPool* pool_ = nullptr;
+      int size_ = 0;
+
+    public:
+      BufferPool() {}
+
+      ~BufferPool()
+      {
+        // buffers still referenced keep the pool alive until they are released
+        av_buffer_pool_uninit(&pool_);
+      }
+
+      BufferPool(const BufferPool&) = delete;
+      BufferPool& operator=(const BufferPool&) = delete;
+
+      int size() const
+      {
+        return size_;
+      }
+
+      AVBufferRef* get(int size)
+      {
+        if (!pool_ || size > size_) {
+          av_buffer_pool_uninit(&pool_);
+          pool_ = av_buffer_pool_init2(size, nullptr, BufferPool::alloc, nullptr);
+          if (!pool_) {
+            size_ = 0;
+            return nullptr;
+          }
+          size_ = size;
+        }
+        return av_buffer_pool_get(pool_);
+      }
+
+    private:
+      static AVBufferRef* alloc(void* opaque, int size)
+      {
+        BEN_COUNT_FRAME_ALLOC();
+        return av_buffer_alloc(size);
+      }
+    };
+
+    // owns an AVFrame shell for its whole life.
+    // moving transfers the frame data reference, not the shell, so a frame
+    // kept across iterations never allocates again.
     class Frame
     {
     private:
@@ -64,6 +156,7 @@ namespace ben {
       {
         if (alloc) {
           frame_ = av_frame_alloc();
+          BEN_COUNT_FRAME_ALLOC();
         }
       }
 
@@ -75,6 +168,96 @@ namespace ben {
         }
       }
 
+      Frame(const Frame&) = delete;
+      Frame& operator=(const Frame&) = delete;
+
+      // steals the shell
+      Frame(Frame&& other)
+        : frame_(other.frame_)
+      {
+        other.frame_ = nullptr;
+      }
+
+      // moves the data reference into this shell
+      Frame& operator=(Frame&& other)
+      {
+        if (this == &other) {
+          return *this;
+        }
+        if (!frame_) {
+          frame_ = other.frame_;
+          other.frame_ = nullptr;
+        } else if (other.frame_) {
+          av_frame_unref(frame_);
+          av_frame_move_ref(frame_, other.frame_);
+        } else {
+          av_frame_unref(frame_);
+        }
+        return *this;
+      }
+
+      void unref()
+      {
+        if (frame_) {
+          av_frame_unref(frame_);
+        }
+      }
+
+      // lines and planes on simd_align : opencv and avx-512 rows without a tail
+      static const int simd_align = 64;
+
+      // image buffer taken from pool. data and linesize are set for the format,
+      // every plane and line starts on align bytes.
+      int get_buffer(BufferPool& pool, AVPixelFormat format, int width, int height, int align = 1)
+      {
+        int size = av_image_get_buffer_size(format, width, height, align);
+        if (size < 0) {
+          return size;
+        }
+
+        unref();
+        frame_->buf[0] = pool.get(size + align - 1);
+        if (!frame_->buf[0]) {
+          return AVERROR(ENOMEM);
+        }
+
+        // pool buffers are only av_malloc aligned
+        uint8_t* data = frame_->buf[0]->data;
+        data += (align - reinterpret_cast<uintptr_t>(data) % align) % align;
+
+        frame_->format = format;
+        frame_->width = width;
+        frame_->height = height;
+        return av_image_fill_arrays(
+          frame_->data,
+          frame_->linesize,
+          data,
+          format,
+          width,
+          height,
+          align
+        );
+      }
+
+      // av_frame_copy_props without the side data (no allocation per frame)
+      static void copy_props(const AVFrame* src, AVFrame* dst)
+      {
+        dst->pts = src->pts;
+        dst->pkt_dts = src->pkt_dts;
+        dst->key_frame = src->key_frame;
+        dst->pict_type = src->pict_type;
+        dst->sample_aspect_ratio = src->sample_aspect_ratio;
+        dst->color_range = src->color_range;
+        dst->color_primaries = src->color_primaries;
+        dst->color_trc = src->color_trc;
+        dst->colorspace = src->colorspace;
+      }
+
+      AVFrame* get()
+      {
+        return frame_;
+      }
+
       operator AVFrame*()
       {
         return frame_;
@@ -87,6 +270,7 @@ namespace ben {
 
     };
 
+    // AVPacket by value, never a heap shell. moving transfers the reference.
     class Packet
     {
     private:
@@ -105,6 +289,55 @@ namespace ben {
         av_packet_unref(&packet_);
       }
 
+      Packet(const Packet&) = delete;
+      Packet& operator=(const Packet&) = delete;
+
+      Packet(Packet&& other)
+      {
+        av_packet_move_ref(&packet_, &other.packet_);
+      }
+
+      Packet& operator=(Packet&& other)
+      {
+        if (this != &other) {
+          av_packet_unref(&packet_);
+          av_packet_move_ref(&packet_, &other.packet_);
+        }
+        return *this;
+      }
+
+      void unref()
+      {
+        av_packet_unref(&packet_);
+      }
+
+      // demuxers may return data they still own. copy it into a pooled buffer
+      // so the packet can outlive the next av_read_frame.
+      int make_refcounted(BufferPool& pool)
+      {
+        if (packet_.buf) {
+          return 0;
+        }
+
+        AVBufferRef* buf = pool.get(packet_.size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!buf) {
+          return AVERROR(ENOMEM);
+        }
+        if (packet_.size > 0) {
+          memcpy(buf->data, packet_.data, packet_.size);
+        }
+        memset(buf->data + packet_.size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+        packet_.buf = buf;
+        packet_.data = buf->data;
+        return 0;
+      }
+
+      AVPacket* get()
+      {
+        return &packet_;
+      }
+
       operator AVPacket*()
       {
         return &packet_;
@@ -118,6 +351,49 @@ namespace ben {
     };
 
 
+    // full range (jpeg) pixel formats. the yuvj names are deprecated : same
+    // planes as their yuv name, with color_range set to AVCOL_RANGE_JPEG.
+    class PixFmt
+    {
+    public:
+      static bool is_jpeg(AVPixelFormat format)
+      {
+        return limited(format) != format;
+      }
+
+      // yuvj -> yuv, others as they are
+      static AVPixelFormat limited(AVPixelFormat format)
+      {
+        switch (format) {
+        case AV_PIX_FMT_YUVJ420P: return AV_PIX_FMT_YUV420P;
+        case AV_PIX_FMT_YUVJ422P: return AV_PIX_FMT_YUV422P;
+        case AV_PIX_FMT_YUVJ444P: return AV_PIX_FMT_YUV444P;
+        case AV_PIX_FMT_YUVJ440P: return AV_PIX_FMT_YUV440P;
+        default: return format;
+        }
+      }
+
+      static bool is_full(AVPixelFormat format, AVColorRange range)
+      {
+        return is_jpeg(format) || range == AVCOL_RANGE_JPEG;
+      }
+
+      // list terminated by AV_PIX_FMT_NONE, null : anything
+      static bool supported(const AVPixelFormat* list, AVPixelFormat format)
+      {
+        if (!list) {
+          return true;
+        }
+        for (; *list != AV_PIX_FMT_NONE; list++) {
+          if (*list == format) {
+            return true;
+          }
+        }
+        return false;
+      }
+    };
+
+
     class Util
     {
     public:
@@ -129,12 +405,12 @@ namespace ben {
           av_make_error_string(av_err_str, AV_ERROR_MAX_STRING_SIZE, ret);
 
           char buf[size] = { 0, };
-          int writed = sprintf_s(buf, "av fail (%d:%s). ", ret, av_err_str);
+          int writed = snprintf(buf, size, "av fail (%d:%s). ", ret, av_err_str);
 
           char* buf2 = buf + writed;
           va_list list;
           va_start(list, fmt);
-          vsnprintf_s(buf2, size - writed, size - writed - 1, fmt, list);
+          vsnprintf(buf2, size - writed, fmt, list);
           va_end(list);
 
           throw std::runtime_error(buf);
@@ -146,12 +422,12 @@ namespace ben {
       {
         if (!ret) {
           char buf[size] = { 0, };
-          int writed = sprintf_s(buf, "av fail. ");
+          int writed = snprintf(buf, size, "av fail. ");
 
           char* buf2 = buf + writed;
           va_list list;
           va_start(list, fmt);
-          vsnprintf_s(buf2, size - writed, size - writed - 1, fmt, list);
+          vsnprintf(buf2, size - writed, fmt, list);
           va_end(list);
 
 
@@ -161,6 +437,7 @@ namespace ben {
 
       static bool chk_exit_key()
       {
+#if defined(_WIN32)
         if (_kbhit() > 0) {
           int ch = _getch();
 
@@ -170,6 +447,30 @@ namespace ben {
           }
         }
         return false;
+#else
+        // non canonical stdin only while polling
+        termios old_tio;
+        if (tcgetattr(STDIN_FILENO, &old_tio) != 0) {
+          return false;
+        }
+        termios raw_tio = old_tio;
+        raw_tio.c_lflag &= ~(ICANON | ECHO);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw_tio);
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(STDIN_FILENO, &fds);
+        timeval tv = { 0, 0 };
+
+        int ch = -1;
+        if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0) {
+          ch = getchar();
+        }
+        tcsetattr(STDIN_FILENO, TCSANOW, &old_tio);
+
+        //ESC : 27, q : 81, Q : 113
+        return ch == 27 || ch == 81 || ch == 113;
+#endif
       }
 
       static void show_dshow_device() {
@@ -245,7 +546,7 @@ namespace ben {
         }
 
         char msg[1024] = { 0 };
-        vsprintf_s(msg, fmt, vargs);
+        vsnprintf(msg, sizeof(msg), fmt, vargs);
         printf(" %s", msg);
       }
 
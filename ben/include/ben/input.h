@@ -0,0 +1,169 @@
+﻿#pragma once
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include "ffmpeg.h"
+
+namespace ben {
+
+  // capture source for Webcam.
+  // open() throws std::runtime_error like the rest of the setup code,
+  // read() returns an av error code like av_read_frame.
+  class Input : public ff::Util
+  {
+  public:
+    virtual ~Input() {}
+
+    // streams and codec parameters must be known after open()
+    virtual void open() = 0;
+
+    virtual AVFormatContext* format_context() = 0;
+
+    virtual int read(ff::Packet& packet) = 0;
+
+    virtual void close() = 0;
+
+    virtual std::string name() const = 0;
+  };
+
+
+  // anything libavformat/libavdevice opens by url
+  // ex) file  : FormatInput("C:\\video.mp4")
+  //     lavfi : FormatInput("testsrc=size=1280x720:rate=30", "lavfi")
+  class FormatInput : public Input
+  {
+  protected:
+    std::string url_;
+    std::string format_name_;
+    AVDictionary* options_ = nullptr;
+    AVFormatContext* ifmt_ctx_ = nullptr;
+
+    // pace packets by their timestamps (like ffmpeg -re)
+    bool realtime_ = false;
+    std::chrono::steady_clock::time_point start_;
+    int64_t start_pts_ = AV_NOPTS_VALUE;
+
+  public:
+    FormatInput(const std::string& url, const std::string& format_name = "")
+      : url_(url), format_name_(format_name)
+    {
+    }
+
+    ~FormatInput()
+    {
+      close();
+      av_dict_free(&options_);
+    }
+
+    // demuxer/device option (av_dict_set). call before open().
+    void set_option(const std::string& key, const std::string& value)
+    {
+      av_dict_set(&options_, key.c_str(), value.c_str(), 0);
+    }
+
+    void set_realtime(bool realtime)
+    {
+      realtime_ = realtime;
+    }
+
+    void open() override
+    {
+      AVInputFormat* input_format = nullptr;
+      if (!format_name_.empty()) {
+        input_format = av_find_input_format(format_name_.c_str());
+        chk(input_format, "input av_find_input_format : %s", format_name_.c_str());
+      }
+
+      AVDictionary* options = nullptr;
+      av_dict_copy(&options, options_, 0);
+
+      ifmt_ctx_ = avformat_alloc_context();
+      int ret = avformat_open_input(&ifmt_ctx_, url_.c_str(), input_format, &options);
+      av_dict_free(&options);
+      chk(ret, "input avformat_open_input : %s", url_.c_str());
+
+      chk(
+        avformat_find_stream_info(ifmt_ctx_, NULL),
+        "input avformat_find_stream_info"
+      );
+
+      start_pts_ = AV_NOPTS_VALUE;
+    }
+
+    AVFormatContext* format_context() override
+    {
+      return ifmt_ctx_;
+    }
+
+    int read(ff::Packet& packet) override
+    {
+      int ret = av_read_frame(ifmt_ctx_, packet);
+      if (ret >= 0 && realtime_) {
+        pace(packet);
+      }
+      return ret;
+    }
+
+    void close() override
+    {
+      avformat_close_input(&ifmt_ctx_);
+    }
+
+    std::string name() const override
+    {
+      return format_name_.empty() ? url_ : format_name_ + ":" + url_;
+    }
+
+  private:
+    void pace(ff::Packet& packet)
+    {
+      if (packet->pts == AV_NOPTS_VALUE) {
+        return;
+      }
+
+      AVRational time_base = ifmt_ctx_->streams[packet->stream_index]->time_base;
+      int64_t pts = av_rescale_q(packet->pts, time_base, AVRational{ 1, 1000000 });
+
+      if (start_pts_ == AV_NOPTS_VALUE) {
+        start_pts_ = pts;
+        start_ = std::chrono::steady_clock::now();
+        return;
+      }
+
+      auto due = start_ + std::chrono::microseconds(pts - start_pts_);
+      std::this_thread::sleep_until(due);
+    }
+  };
+
+
+  // DirectShow device (windows). same options Webcam always used.
+  class DshowInput : public FormatInput
+  {
+  public:
+    DshowInput(const std::string& video_name, const std::string& audio_name = "")
+      : FormatInput(device_name(video_name, audio_name), "dshow")
+    {
+      set_rtbufsize(64 * 1024 * 1024);
+    }
+
+    // device side real-time buffer. dshow drops frames itself once it is full,
+    // so keep it small and let Webcam::set_capture_buffer decide what to drop.
+    void set_rtbufsize(int64_t bytes)
+    {
+      set_option("rtbufsize", std::to_string(bytes));
+    }
+
+  private:
+    static std::string device_name(const std::string& video_name, const std::string& audio_name)
+    {
+      std::string device_name = "video=";
+      device_name.append(video_name);
+      if (!audio_name.empty()) {
+        device_name.append(":audio=");
+        device_name.append(audio_name);
+      }
+      return device_name;
+    }
+  };
+}
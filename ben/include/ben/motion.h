@@ -0,0 +1,307 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define BEN_MOTION_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+#endif
+
+#include "ffmpeg.h"
+
+namespace ben {
+
+  struct MotionOptions
+  {
+    int scale = 4;                       // luma averaged over scale x scale blocks
+    int pixel_threshold = 16;            // block luma difference that counts as changed
+    double area = 0.002;                 // changed blocks / all blocks that count as motion
+    int pre_roll_ms = 1000;              // decoded frames kept while idle, encoded when motion starts
+    int post_roll_ms = 3000;             // encoding goes on this long after the last motion
+    std::size_t max_pre_roll_frames = 64; // cap of kept frames (all gated streams), bounds memory
+  };
+
+
+  // frame difference on a downsampled luma plane.
+  // 8 bit formats only : luma, or the first component of rgb/packed formats.
+  class MotionDetector
+  {
+  private:
+    MotionOptions options_;
+    std::vector<uint8_t> prev_;
+    std::vector<uint8_t> cur_;
+    std::vector<uint32_t> sums_;
+    int width_ = 0;
+    int height_ = 0;
+    bool have_prev_ = false;
+
+  public:
+    MotionDetector(const MotionOptions& options = MotionOptions())
+      : options_(options)
+    {
+      options_.scale = std::max(1, std::min(options_.scale, 64));
+    }
+
+    void reset()
+    {
+      have_prev_ = false;
+    }
+
+    // true when enough of the picture changed since the previous frame.
+    // a frame it can not look at always counts as motion.
+    bool detect(const AVFrame* frame)
+    {
+      const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+      if (
+        !desc ||
+        (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM)) ||
+        desc->comp[0].depth != 8
+      ) {
+        return true;
+      }
+
+      int width = frame->width / options_.scale;
+      int height = frame->height / options_.scale;
+      if (width <= 0 || height <= 0) {
+        return true;
+      }
+      if (width != width_ || height != height_) {
+        width_ = width;
+        height_ = height;
+        prev_.resize(width * height);
+        cur_.resize(width * height);
+        sums_.resize(width);
+        have_prev_ = false;
+      }
+
+      downsample(frame, desc->comp[0]);
+
+      bool motion = false;
+      if (have_prev_) {
+        int n = width_ * height_;
+        int changed = count_changed(prev_.data(), cur_.data(), n, static_cast<uint8_t>(options_.pixel_threshold));
+        motion = changed >= std::max(1, static_cast<int>(options_.area * n));
+      }
+      prev_.swap(cur_);
+      have_prev_ = true;
+      return motion;
+    }
+
+    // blocks of a and b differing by more than threshold
+    static int count_changed(const uint8_t* a, const uint8_t* b, int n, uint8_t threshold)
+    {
+      int i = 0;
+      uint64_t count = 0;
+
+#if defined(__AVX2__)
+      const __m256i zero = _mm256_setzero_si256();
+      const __m256i one = _mm256_set1_epi8(1);
+      const __m256i thr = _mm256_set1_epi8(static_cast<char>(threshold));
+      __m256i total = zero;
+      while (n - i >= 32) {
+        // byte counters, summed before they can wrap
+        __m256i acc = zero;
+        for (int k = 0; k < 255 && n - i >= 32; k++, i += 32) {
+          __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+          __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+          __m256i diff = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+          acc = _mm256_add_epi8(acc, _mm256_min_epu8(_mm256_subs_epu8(diff, thr), one));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(acc, zero));
+      }
+      alignas(32) uint64_t lanes[4];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), total);
+      count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(BEN_MOTION_SSE2)
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i one = _mm_set1_epi8(1);
+      const __m128i thr = _mm_set1_epi8(static_cast<char>(threshold));
+      __m128i total = zero;
+      while (n - i >= 16) {
+        __m128i acc = zero;
+        for (int k = 0; k < 255 && n - i >= 16; k++, i += 16) {
+          __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+          __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+          __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+          acc = _mm_add_epi8(acc, _mm_min_epu8(_mm_subs_epu8(diff, thr), one));
+        }
+        total = _mm_add_epi64(total, _mm_sad_epu8(acc, zero));
+      }
+      alignas(16) uint64_t lanes[2];
+      _mm_store_si128(reinterpret_cast<__m128i*>(lanes), total);
+      count = lanes[0] + lanes[1];
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+      const uint8x16_t thr = vdupq_n_u8(threshold);
+      uint64x2_t total = vdupq_n_u64(0);
+      while (n - i >= 16) {
+        uint8x16_t acc = vdupq_n_u8(0);
+        for (int k = 0; k < 255 && n - i >= 16; k++, i += 16) {
+          uint8x16_t diff = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+          acc = vaddq_u8(acc, vshrq_n_u8(vcgtq_u8(diff, thr), 7));
+        }
+        total = vaddq_u64(total, vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(acc))));
+      }
+      count = vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1);
+#endif
+
+      for (; i < n; i++) {
+        int diff = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        if (diff > threshold) {
+          count++;
+        }
+      }
+      return static_cast<int>(count);
+    }
+
+  private:
+    // block averages of one component into cur_
+    void downsample(const AVFrame* frame, const AVComponentDescriptor& comp)
+    {
+      const int scale = options_.scale;
+      const int step = comp.step;
+      const uint32_t area = scale * scale;
+
+      for (int y = 0; y < height_; y++) {
+        std::fill(sums_.begin(), sums_.end(), 0);
+        for (int k = 0; k < scale; k++) {
+          const uint8_t* src =
+            frame->data[comp.plane] +
+            static_cast<ptrdiff_t>(y * scale + k) * frame->linesize[comp.plane] +
+            comp.offset;
+          for (int x = 0; x < width_; x++) {
+            uint32_t sum = 0;
+            for (int j = 0; j < scale; j++, src += step) {
+              sum += *src;
+            }
+            sums_[x] += sum;
+          }
+        }
+
+        uint8_t* dst = cur_.data() + y * width_;
+        for (int x = 0; x < width_; x++) {
+          dst[x] = static_cast<uint8_t>(sums_[x] / area);
+        }
+      }
+    }
+  };
+
+
+  // decides which decoded frames get encoded. idle until motion, then active
+  // until post_roll_ms without motion. frames arriving while idle are held
+  // (pre roll) and handed back in order when motion starts.
+  class MotionGate
+  {
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Held
+    {
+      ff::Frame frame;
+      int stream_index = 0;
+      Clock::time_point time;
+    };
+
+    MotionOptions options_;
+    MotionDetector detector_;
+    bool active_ = false;
+    Clock::time_point active_until_;
+
+    // ring of frame shells, allocated once
+    std::vector<Held> held_;
+    std::size_t held_head_ = 0;
+    std::size_t held_count_ = 0;
+
+  public:
+    MotionGate(const MotionOptions& options = MotionOptions())
+      : options_(options),
+      detector_(options),
+      held_(options.pre_roll_ms > 0 ? options.max_pre_roll_frames : 0)
+    {
+    }
+
+    bool active() const
+    {
+      return active_;
+    }
+
+    // a video frame of the watched stream
+    bool update(const AVFrame* frame)
+    {
+      Clock::time_point now = Clock::now();
+      if (detector_.detect(frame)) {
+        active_ = true;
+        active_until_ = now + std::chrono::milliseconds(options_.post_roll_ms);
+      } else if (active_ && now >= active_until_) {
+        active_ = false;
+      }
+      return active_;
+    }
+
+    // keeps the frame reference for pre roll. returns the frames given up
+    // (too old, ring full, or this one when there is no pre roll).
+    std::size_t hold(ff::Frame& frame, int stream_index)
+    {
+      if (held_.empty()) {
+        frame.unref();
+        return 1;
+      }
+
+      Clock::time_point now = Clock::now();
+      std::chrono::milliseconds pre_roll(options_.pre_roll_ms);
+      std::size_t dropped = 0;
+      while (
+        held_count_ > 0 &&
+        (held_count_ == held_.size() || now - held_[held_head_].time > pre_roll)
+      ) {
+        pop();
+        dropped++;
+      }
+
+      Held& slot = held_[(held_head_ + held_count_) % held_.size()];
+      slot.frame = std::move(frame);
+      slot.stream_index = stream_index;
+      slot.time = now;
+      held_count_++;
+      return dropped;
+    }
+
+    // held frames, oldest first. f returns < 0 to stop (the rest is kept).
+    template <typename F>
+    int release(F f)
+    {
+      while (held_count_ > 0) {
+        Held& slot = held_[held_head_];
+        int ret = f(slot.frame, slot.stream_index);
+        pop();
+        if (ret < 0) {
+          return ret;
+        }
+      }
+      return 0;
+    }
+
+    void reset()
+    {
+      while (held_count_ > 0) {
+        pop();
+      }
+      active_ = false;
+      detector_.reset();
+    }
+
+  private:
+    void pop()
+    {
+      held_[held_head_].frame.unref();
+      held_head_ = (held_head_ + 1) % held_.size();
+      held_count_--;
+    }
+  };
+}
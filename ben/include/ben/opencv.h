@@ -1,5 +1,9 @@
 ﻿#pragma once
 
+#include <stdexcept>
+#include <vector>
+#include "ffmpeg.h"
+
 #pragma warning(disable: 4819)
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -10,3 +14,125 @@
 #pragma comment (lib, "opencv_world330.lib")
 #endif
 #pragma warning(default: 4819)
+
+
+namespace ben {
+
+  // cv::Mat over the planes of a frame, no copy. step is the frame linesize.
+  // the Mat holds its own reference of the AVBufferRef behind the plane : the
+  // frame may be unreferenced or reused while the Mat (and every Mat copied
+  // from it) lives. 8 bit formats only.
+  // ex) subscriber with FrameFormat pix_fmt AV_PIX_FMT_BGR24 :
+  //   cv::Mat img = MatFrame::bgr(frame);
+  class MatFrame
+  {
+  public:
+    // bgr24 as CV_8UC3
+    static cv::Mat bgr(const AVFrame* frame)
+    {
+      if (frame->format != AV_PIX_FMT_BGR24) {
+        throw std::runtime_error("MatFrame::bgr : not a bgr24 frame");
+      }
+      return plane(frame, 0);
+    }
+
+    // Y, U, V of planar yuv (CV_8UC1, chroma planes at chroma size), UV of nv12
+    // (CV_8UC2), the whole picture of packed formats (yuyv422 CV_8UC2, bgr24 CV_8UC3)
+    static cv::Mat plane(const AVFrame* frame, int index)
+    {
+      AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+      const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+      if (!desc ||
+        (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_PAL)) ||
+        desc->comp[0].depth > 8)
+      {
+        throw std::runtime_error("MatFrame : not an 8 bit format");
+      }
+      if (index < 0 || index >= av_pix_fmt_count_planes(format)) {
+        throw std::runtime_error("MatFrame : no such plane");
+      }
+      if (frame->linesize[index] < 0) {
+        throw std::runtime_error("MatFrame : bottom up frame");
+      }
+
+      bool chroma = index == 1 || index == 2;
+      int width = chroma ? AV_CEIL_RSHIFT(frame->width, desc->log2_chroma_w) : frame->width;
+      int height = chroma ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+      int bytes = av_image_get_linesize(format, frame->width, index);
+      int channels = width > 0 ? bytes / width : 0;
+      if (channels < 1 || channels > 4 || bytes != channels * width) {
+        throw std::runtime_error("MatFrame : not a whole byte per channel");
+      }
+
+      AVBufferRef* buf = av_frame_get_plane_buffer(const_cast<AVFrame*>(frame), index);
+      if (!buf) {
+        throw std::runtime_error("MatFrame : frame is not reference counted");
+      }
+      buf = av_buffer_ref(buf);
+      if (!buf) {
+        throw std::runtime_error("MatFrame : av_buffer_ref");
+      }
+
+      cv::Mat mat(
+        height,
+        width,
+        CV_8UC(channels),
+        frame->data[index],
+        static_cast<size_t>(frame->linesize[index])
+      );
+
+      // the last Mat released gives the reference back (BufferAllocator::deallocate)
+      cv::UMatData* u = new cv::UMatData(&allocator());
+      u->data = u->origdata = buf->data;
+      u->size = buf->size;
+      u->userdata = buf;
+      u->refcount = 1;
+      mat.u = u;
+      return mat;
+    }
+
+    // every plane : 3 for yuv420p, 2 for nv12, 1 for packed formats
+    static std::vector<cv::Mat> planes(const AVFrame* frame)
+    {
+      std::vector<cv::Mat> mats;
+      int count = av_pix_fmt_count_planes(static_cast<AVPixelFormat>(frame->format));
+      for (int i = 0; i < count; i++) {
+        mats.push_back(plane(frame, i));
+      }
+      return mats;
+    }
+
+  private:
+    // owner of the UMatData of MatFrame Mats. Mats that get new data (create,
+    // copyTo a different size) allocate from the default allocator.
+    class BufferAllocator : public cv::MatAllocator
+    {
+    public:
+      cv::UMatData* allocate(
+        int dims, const int* sizes, int type, void* data, size_t* step,
+        int flags, cv::UMatUsageFlags usage
+      ) const override
+      {
+        return cv::Mat::getDefaultAllocator()->allocate(dims, sizes, type, data, step, flags, usage);
+      }
+
+      bool allocate(cv::UMatData* u, int access, cv::UMatUsageFlags usage) const override
+      {
+        return cv::Mat::getDefaultAllocator()->allocate(u, access, usage);
+      }
+
+      void deallocate(cv::UMatData* u) const override
+      {
+        AVBufferRef* buf = static_cast<AVBufferRef*>(u->userdata);
+        av_buffer_unref(&buf);
+        delete u;
+      }
+    };
+
+    static BufferAllocator& allocator()
+    {
+      static BufferAllocator instance;
+      return instance;
+    }
+  };
+}
@@ -0,0 +1,355 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ffmpeg.h"
+#include "sink.h"
+
+namespace ben {
+
+  // keeps the last pre_seconds of output packets in a preallocated ring and,
+  // on trigger(), writes them to a file from the oldest buffered keyframe,
+  // then keeps recording live until post_seconds after the last trigger.
+  // added with Webcam::add_sink, so it sees encoded and remuxed packets alike.
+  // keep a raw pointer to call trigger() : the Webcam owns the sink.
+  // a recording that fails (file, muxer) is dropped and reported, the ring
+  // keeps buffering for the next trigger.
+  // ex)
+  //   PreEventSink* pre_event = new PreEventSink(10);
+  //   wc.add_sink(std::unique_ptr<Sink>(pre_event));
+  //   ...
+  //   pre_event->trigger("event_001.mkv", 30);
+  class PreEventSink : public Sink
+  {
+  private:
+    struct Entry
+    {
+      std::size_t offset = 0;
+      int size = 0;
+      int64_t pts = AV_NOPTS_VALUE;
+      int64_t dts = AV_NOPTS_VALUE;
+      int64_t duration = 0;
+      int stream_index = 0;
+      int flags = 0;
+      std::chrono::steady_clock::time_point time;
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    std::chrono::microseconds pre_roll_;
+
+    // packet data, written circularly. entry ring and keyframe index hold sequence numbers.
+    std::vector<uint8_t> arena_;
+    std::size_t write_pos_ = 0;
+    std::vector<Entry> entries_;
+    uint64_t head_ = 0; // oldest entry
+    uint64_t tail_ = 0; // next entry
+    std::vector<uint64_t> keyframes_;
+    uint64_t key_head_ = 0;
+    uint64_t key_tail_ = 0;
+
+    AVFormatContext* layout_ = nullptr; // own copy of the stream layout
+    int key_stream_ = -1;
+
+    // trigger() -> sink thread
+    std::mutex trigger_mutex_;
+    std::atomic<bool> triggered_{ false };
+    std::string trigger_filename_;
+    std::chrono::microseconds trigger_post_roll_{ 0 };
+
+    // sink thread
+    std::unique_ptr<MuxerSink> recorder_;
+    Clock::time_point record_until_;
+    bool wait_keyframe_ = false;
+    std::atomic<bool> recording_{ false };
+
+    // failed recordings, any thread reads them
+    mutable std::mutex error_mutex_;
+    std::string last_error_;
+    std::atomic<uint64_t> failed_recordings_{ 0 };
+
+  public:
+    // pre_seconds : kept before a trigger.
+    // arena_bytes / max_packets : hard bound of the ring, the oldest packets
+    // go first when either is reached.
+    PreEventSink(int pre_seconds, std::size_t arena_bytes = 64 * 1024 * 1024, std::size_t max_packets = 8192)
+      : pre_roll_(std::chrono::seconds(pre_seconds)),
+      arena_(arena_bytes),
+      entries_(max_packets),
+      keyframes_(max_packets)
+    {
+    }
+
+    ~PreEventSink()
+    {
+      free_layout();
+    }
+
+    // any thread. starts a recording into filename, or extends the running one.
+    void trigger(const std::string& filename, int post_seconds)
+    {
+      std::lock_guard<std::mutex> lock(trigger_mutex_);
+      trigger_filename_ = filename;
+      trigger_post_roll_ = std::chrono::seconds(post_seconds);
+      triggered_ = true;
+    }
+
+    bool recording() const
+    {
+      return recording_;
+    }
+
+    uint64_t failed_recordings() const
+    {
+      return failed_recordings_;
+    }
+
+    // error of the last failed recording, empty when none failed
+    std::string last_error() const
+    {
+      std::lock_guard<std::mutex> lock(error_mutex_);
+      return last_error_;
+    }
+
+    void open(const AVFormatContext* layout) override
+    {
+      free_layout();
+      layout_ = avformat_alloc_context();
+      chk(layout_, "pre event avformat_alloc_context");
+
+      key_stream_ = -1;
+      for (unsigned int i = 0; i < layout->nb_streams; i++) {
+        AVStream* out_stream = avformat_new_stream(layout_, NULL);
+        chk(out_stream, "pre event avformat_new_stream[stream: %u]", i);
+        chk(
+          avcodec_parameters_copy(out_stream->codecpar, layout->streams[i]->codecpar),
+          "pre event avcodec_parameters_copy[stream: %u]", i
+        );
+        out_stream->time_base = layout->streams[i]->time_base;
+        if (key_stream_ < 0 && out_stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+          key_stream_ = i;
+        }
+      }
+
+      head_ = tail_ = 0;
+      key_head_ = key_tail_ = 0;
+      write_pos_ = 0;
+    }
+
+    void write(ff::Packet& packet) override
+    {
+      Clock::time_point now = Clock::now();
+
+      if (triggered_) {
+        start_recording(now);
+      }
+
+      append(packet, now);
+
+      if (recording_) {
+        if (now >= record_until_) {
+          stop_recording();
+        } else if (!wait_keyframe_ || is_key(packet)) {
+          wait_keyframe_ = false;
+          try {
+            recorder_->write(packet);
+          } catch (std::runtime_error& e) {
+            drop_recording(e.what());
+          }
+        }
+      }
+    }
+
+    void close() override
+    {
+      stop_recording();
+      free_layout();
+    }
+
+    std::string name() const override
+    {
+      return "pre event";
+    }
+
+  private:
+    bool is_key(ff::Packet& packet) const
+    {
+      return
+        key_stream_ < 0 ||
+        (packet->stream_index == key_stream_ && (packet->flags & AV_PKT_FLAG_KEY));
+    }
+
+    Entry& entry(uint64_t seq)
+    {
+      return entries_[seq % entries_.size()];
+    }
+
+    void append(ff::Packet& packet, Clock::time_point now)
+    {
+      std::size_t size = packet->size;
+      if (size == 0 || size > arena_.size() / 2) {
+        // never fits with anything else : not buffered
+        return;
+      }
+
+      // packet data is contiguous : wrap when the end is too short
+      std::size_t offset = write_pos_;
+      if (offset + size > arena_.size()) {
+        offset = 0;
+      }
+      while (head_ != tail_ && (tail_ - head_ == entries_.size() || overlaps(offset, size))) {
+        evict();
+      }
+
+      memcpy(arena_.data() + offset, packet->data, size);
+      write_pos_ = offset + size;
+
+      Entry& e = entry(tail_);
+      e.offset = offset;
+      e.size = static_cast<int>(size);
+      e.pts = packet->pts;
+      e.dts = packet->dts;
+      e.duration = packet->duration;
+      e.stream_index = packet->stream_index;
+      e.flags = packet->flags;
+      e.time = now;
+
+      if (is_key(packet)) {
+        keyframes_[key_tail_ % keyframes_.size()] = tail_;
+        key_tail_++;
+      }
+      tail_++;
+
+      // whole gops out while the next one still starts before the pre roll
+      while (key_tail_ - key_head_ >= 2) {
+        uint64_t next_key = keyframes_[(key_head_ + 1) % keyframes_.size()];
+        if (now - entry(next_key).time < pre_roll_) {
+          break;
+        }
+        while (head_ < next_key) {
+          evict();
+        }
+      }
+    }
+
+    // offset..offset+size collides with live data (head .. write_pos_)
+    bool overlaps(std::size_t offset, std::size_t size)
+    {
+      std::size_t begin = entry(head_).offset;
+      std::size_t end = write_pos_;
+      if (begin < end) {
+        return offset < end && offset + size > begin;
+      }
+      // live data wraps : [begin, arena end) and [0, end)
+      return offset < end || offset + size > begin;
+    }
+
+    void evict()
+    {
+      if (key_head_ != key_tail_ && keyframes_[key_head_ % keyframes_.size()] == head_) {
+        key_head_++;
+      }
+      head_++;
+      if (head_ == tail_) {
+        write_pos_ = 0;
+      }
+    }
+
+    void start_recording(Clock::time_point now)
+    {
+      std::string filename;
+      std::chrono::microseconds post_roll;
+      {
+        std::lock_guard<std::mutex> lock(trigger_mutex_);
+        filename = trigger_filename_;
+        post_roll = trigger_post_roll_;
+        triggered_ = false;
+      }
+
+      record_until_ = now + post_roll;
+      if (recording_) {
+        // retrigger : same file, longer
+        return;
+      }
+
+      try {
+        record(filename);
+      } catch (std::runtime_error& e) {
+        drop_recording(e.what());
+      }
+    }
+
+    void record(const std::string& filename)
+    {
+      recorder_.reset(new MuxerSink(filename));
+      recorder_->open(layout_);
+      recording_ = true;
+
+      if (key_head_ == key_tail_) {
+        // nothing decodable buffered yet
+        wait_keyframe_ = true;
+        return;
+      }
+
+      // buffered part, from the oldest keyframe
+      ff::Packet packet;
+      for (uint64_t seq = keyframes_[key_head_ % keyframes_.size()]; seq < tail_; seq++) {
+        Entry& e = entry(seq);
+        packet.unref();
+        packet->data = arena_.data() + e.offset; // not refcounted : the muxer copies it
+        packet->size = e.size;
+        packet->pts = e.pts;
+        packet->dts = e.dts;
+        packet->duration = e.duration;
+        packet->stream_index = e.stream_index;
+        packet->flags = e.flags;
+        recorder_->write(packet);
+      }
+      wait_keyframe_ = false;
+    }
+
+    void stop_recording()
+    {
+      if (!recorder_) {
+        return;
+      }
+      recording_ = false;
+      std::unique_ptr<MuxerSink> recorder = std::move(recorder_);
+      try {
+        recorder->close();
+      } catch (std::runtime_error& e) {
+        report(e.what());
+      }
+    }
+
+    // this recording only : no trailer, the sink itself goes on
+    void drop_recording(const char* what)
+    {
+      recording_ = false;
+      wait_keyframe_ = false;
+      recorder_.reset();
+      report(what);
+    }
+
+    void report(const char* what)
+    {
+      {
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        last_error_ = what;
+      }
+      failed_recordings_++;
+      av_log(nullptr, AV_LOG_ERROR, "pre event recording failed : %s\n", what);
+    }
+
+    void free_layout()
+    {
+      avformat_free_context(layout_);
+      layout_ = nullptr;
+    }
+  };
+}
@@ -0,0 +1,337 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "color.h"
+#include "ffmpeg.h"
+#include "worker_pool.h"
+
+namespace ben {
+
+  // sws_scale in horizontal slices, each on its own SwsContext, run on a small
+  // WorkerPool plus the calling thread. the output is the one of a single
+  // context with the same flags :
+  // - slices start on 16 row boundaries (chroma rows, sws dither phase)
+  // - a slice context also scales up to 16 rows above and below it for the
+  //   vertical filter taps, those rows go to a scratch frame and are dropped
+  // - the height ratio in lowest terms must have a denominator of 1, 2, 4 or 8
+  //   (2160 -> 720, 1080 -> 720, 1080 -> 480 ...) : swscale's 16.16 vertical step
+  //   is then exact and every slice context lands on the filter positions of the
+  //   single one. other sizes (1080 -> 400) run on one context, on one core :
+  //   slices() is 1 then.
+  // same size bgr24 from a YuvToBgr format goes to YuvToBgr in slices instead.
+  class SliceScaler : public ff::Util
+  {
+  private:
+    static const int align_ = 16;
+    static const int margin_ = 16; // output rows
+
+    struct Slice
+    {
+      int dst_y = 0;      // first output row
+      int dst_h = 0;
+      int top = 0;        // rows scaled above dst_y and dropped
+      int bottom = 0;     // same, below
+      int src_y = 0;
+      int src_h = 0;
+      SwsContext* sws = nullptr;
+      ff::Frame scratch;  // top + dst_h + bottom rows, when there are margins
+    };
+
+    class SliceTask : public Task
+    {
+    public:
+      SliceScaler* owner = nullptr;
+      std::size_t index = 0;
+
+      void run() override
+      {
+        owner->run_slice(index);
+      }
+    };
+
+    std::size_t threads_;
+    int flags_;
+    std::unique_ptr<WorkerPool> pool_; // made for the first sliced frame
+    ff::BufferPool scratch_pool_;
+
+    // geometry the slices were made for
+    int src_width_ = 0;
+    int src_height_ = 0;
+    int src_format_ = AV_PIX_FMT_NONE;
+    int dst_width_ = 0;
+    int dst_height_ = 0;
+    int dst_format_ = AV_PIX_FMT_NONE;
+    bool src_full_ = false;
+    bool dst_full_ = false;
+    bool bt709_ = false;
+    bool kernel_ = false;
+    std::vector<std::unique_ptr<Slice>> slices_;
+    std::vector<SliceTask> tasks_;
+    std::atomic<std::size_t> slice_count_{ 0 }; // slices_.size() for other threads
+
+    // frame being scaled
+    const AVFrame* src_ = nullptr;
+    AVFrame* dst_ = nullptr;
+    std::mutex done_mutex_;
+    std::condition_variable done_cv_;
+    std::size_t done_ = 0;
+    std::atomic<int> error_{ 0 };
+
+  public:
+    // threads : slices at a time, the caller included. 0 : up to 4.
+    // flags : SWS_BICUBIC, SWS_POINT ... for every context
+    explicit SliceScaler(std::size_t threads = 0, int flags = SWS_BICUBIC)
+      : threads_(threads), flags_(flags)
+    {
+      if (threads_ == 0) {
+        threads_ = std::min(4u, std::max(1u, std::thread::hardware_concurrency()));
+      }
+    }
+
+    ~SliceScaler()
+    {
+      // workers are idle between frames
+      pool_.reset();
+      free_slices();
+    }
+
+    SliceScaler(const SliceScaler&) = delete;
+    SliceScaler& operator=(const SliceScaler&) = delete;
+
+    // dst : format, width and height set, buffers allocated.
+    // range and matrix come from the frames (yuvj, color_range, bt709).
+    void scale(const AVFrame* src, AVFrame* dst)
+    {
+      plan(src, dst);
+
+      src_ = src;
+      dst_ = dst;
+      error_ = 0;
+      {
+        std::lock_guard<std::mutex> lock(done_mutex_);
+        done_ = 0;
+      }
+      for (std::size_t i = 1; i < tasks_.size(); i++) {
+        pool_->submit(&tasks_[i]);
+      }
+      run_slice(0);
+
+      {
+        std::unique_lock<std::mutex> lock(done_mutex_);
+        done_cv_.wait(lock, [&]() { return done_ == slices_.size(); });
+      }
+      src_ = nullptr;
+      dst_ = nullptr;
+      chk(error_, "slice sws_scale");
+    }
+
+    // slices of the last frame, any thread. 1 : one core (sizes not sliceable,
+    // or threads 1), 0 : nothing scaled yet.
+    std::size_t slices() const
+    {
+      return slice_count_;
+    }
+
+  private:
+    void plan(const AVFrame* src, const AVFrame* dst)
+    {
+      AVPixelFormat src_format = static_cast<AVPixelFormat>(src->format);
+      AVPixelFormat dst_format = static_cast<AVPixelFormat>(dst->format);
+      const AVPixFmtDescriptor* src_desc = av_pix_fmt_desc_get(src_format);
+      const AVPixFmtDescriptor* dst_desc = av_pix_fmt_desc_get(dst_format);
+      chk(src_desc && dst_desc ? 0 : AVERROR(EINVAL), "slice pixel format");
+
+      bool src_full = ff::PixFmt::is_full(src_format, src->color_range);
+      bool dst_full = (dst_desc->flags & AV_PIX_FMT_FLAG_RGB) || ff::PixFmt::is_full(dst_format, dst->color_range);
+      bool bt709 = src->colorspace == AVCOL_SPC_BT709;
+
+      if (
+        !slices_.empty() &&
+        src_width_ == src->width && src_height_ == src->height && src_format_ == src_format &&
+        dst_width_ == dst->width && dst_height_ == dst->height && dst_format_ == dst_format &&
+        src_full_ == src_full && dst_full_ == dst_full && bt709_ == bt709
+      ) {
+        return;
+      }
+
+      free_slices();
+      src_width_ = src->width;
+      src_height_ = src->height;
+      src_format_ = src_format;
+      dst_width_ = dst->width;
+      dst_height_ = dst->height;
+      dst_format_ = dst_format;
+      src_full_ = src_full;
+      dst_full_ = dst_full;
+      bt709_ = bt709;
+
+      kernel_ =
+        dst_format == AV_PIX_FMT_BGR24 &&
+        src->width == dst->width && src->height == dst->height &&
+        YuvToBgr::supported(src_format);
+
+      // input rows per output row : num / den in lowest terms, num 0 : not sliceable.
+      // den divides 8 : a slice starts on a multiple of 16 output rows, so on an
+      // even input row (chroma), and (src << 16) / dst has no remainder
+      int num = 0;
+      int den = 1;
+      if (dst->height > 0 && src->height > 0) {
+        int a = src->height;
+        int b = dst->height;
+        while (b) {
+          int r = a % b;
+          a = b;
+          b = r;
+        }
+        num = src->height / a;
+        den = dst->height / a;
+        if (8 % den != 0 || (align_ / den * num) % (1 << src_desc->log2_chroma_h) != 0) {
+          num = 0;
+        }
+      }
+      // plane 1 of a paletted format is the palette
+      if ((src_desc->flags | dst_desc->flags) & AV_PIX_FMT_FLAG_PAL) {
+        num = 0;
+      }
+
+      int rows = dst->height;
+      if ((kernel_ || num > 0) && threads_ > 1) {
+        rows = (dst->height + static_cast<int>(threads_) - 1) / static_cast<int>(threads_);
+        rows = (rows + align_ - 1) / align_ * align_;
+      }
+      bool sliced = rows < dst->height;
+
+      // point sampling at the same height : every output row from its own input rows
+      int margin = kernel_ || (num == 1 && den == 1 && (flags_ & SWS_POINT)) ? 0 : margin_;
+
+      const int* coeffs = sws_getCoefficients(bt709 ? SWS_CS_ITU709 : SWS_CS_DEFAULT);
+      for (int y = 0; y < dst->height; y += rows) {
+        std::unique_ptr<Slice> slice(new Slice());
+        slice->dst_y = y;
+        slice->dst_h = std::min(rows, dst->height - y);
+        if (sliced) {
+          slice->top = std::min(margin, y);
+          slice->bottom = std::min(margin, dst->height - y - slice->dst_h);
+          slice->src_y = (y - slice->top) * num / den;
+          slice->src_h = (slice->top + slice->dst_h + slice->bottom) * num / den;
+        } else {
+          slice->src_h = src->height;
+        }
+        Slice& s = *slice;
+        slices_.push_back(std::move(slice));
+
+        if (kernel_) {
+          continue;
+        }
+
+        int out_h = s.top + s.dst_h + s.bottom;
+        s.sws = sws_getContext(
+          src->width, s.src_h, ff::PixFmt::limited(src_format),
+          dst->width, out_h, ff::PixFmt::limited(dst_format),
+          flags_, NULL, NULL, NULL
+        );
+        chk(s.sws, "slice sws_getContext[row: %d]", y);
+        // yuvj went in as yuv : the range is passed instead
+        sws_setColorspaceDetails(s.sws, coeffs, src_full ? 1 : 0, coeffs, dst_full ? 1 : 0, 0, 1 << 16, 1 << 16);
+
+        if (s.top || s.bottom) {
+          chk(
+            s.scratch.get_buffer(scratch_pool_, dst_format, dst->width, out_h, 32),
+            "slice scratch get_buffer"
+          );
+        }
+      }
+
+      tasks_.resize(slices_.size());
+      slice_count_ = slices_.size();
+      for (std::size_t i = 0; i < tasks_.size(); i++) {
+        tasks_[i].owner = this;
+        tasks_[i].index = i;
+      }
+      if (tasks_.size() > 1 && !pool_) {
+        pool_.reset(new WorkerPool(threads_ - 1));
+      }
+    }
+
+    void free_slices()
+    {
+      for (auto& slice : slices_) {
+        sws_freeContext(slice->sws);
+      }
+      slices_.clear();
+      tasks_.clear();
+    }
+
+    // pool thread or caller. never throws : the result goes to error_.
+    void run_slice(std::size_t index)
+    {
+      Slice& s = *slices_[index];
+
+      if (kernel_) {
+        YuvToBgr::convert(src_, dst_->data[0], dst_->linesize[0], YuvToBgr::cpu(), s.dst_y, s.dst_y + s.dst_h);
+      } else {
+        const uint8_t* src[4] = { nullptr, };
+        planes(src_, s.src_y, src);
+
+        uint8_t* dst[4] = { nullptr, };
+        const int* dst_linesize = dst_->linesize;
+        if (s.scratch->buf[0]) {
+          planes(s.scratch.get(), 0, dst);
+          dst_linesize = s.scratch->linesize;
+        } else {
+          planes(dst_, s.dst_y, dst);
+        }
+
+        int ret = sws_scale(s.sws, src, src_->linesize, 0, s.src_h, dst, dst_linesize);
+        if (ret < 0) {
+          error_ = ret;
+        } else if (s.scratch->buf[0]) {
+          copy_rows(s);
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(done_mutex_);
+      done_++;
+      done_cv_.notify_one();
+    }
+
+    // plane pointers of frame at row y (a multiple of align_ or 0)
+    template <typename T>
+    static void planes(const AVFrame* frame, int y, T* data[4])
+    {
+      const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+      for (int p = 0; p < 4 && frame->data[p]; p++) {
+        int shift = p == 1 || p == 2 ? desc->log2_chroma_h : 0;
+        data[p] = frame->data[p] + static_cast<std::ptrdiff_t>(y >> shift) * frame->linesize[p];
+      }
+    }
+
+    // the slice rows out of the scratch frame
+    void copy_rows(Slice& s)
+    {
+      AVPixelFormat format = static_cast<AVPixelFormat>(dst_->format);
+      const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+      int count = av_pix_fmt_count_planes(format);
+      for (int p = 0; p < count; p++) {
+        int shift = p == 1 || p == 2 ? desc->log2_chroma_h : 0;
+        // the last slice ends on the last (maybe odd) row
+        int end = -((-(s.dst_y + s.dst_h)) >> shift);
+        int begin = s.dst_y >> shift;
+        av_image_copy_plane(
+          dst_->data[p] + static_cast<std::ptrdiff_t>(begin) * dst_->linesize[p],
+          dst_->linesize[p],
+          s.scratch->data[p] + static_cast<std::ptrdiff_t>(s.top >> shift) * s.scratch->linesize[p],
+          s.scratch->linesize[p],
+          av_image_get_linesize(format, dst_->width, p),
+          end - begin
+        );
+      }
+    }
+  };
+}
@@ -0,0 +1,299 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ffmpeg.h"
+#include "spsc_queue.h"
+
+namespace ben {
+
+  // extra destination for the packets Webcam writes (tee).
+  // every method runs on the sink's own thread, so a slow sink only delays itself.
+  // open(), write() and close() throw std::runtime_error like the rest of the code.
+  class Sink : public ff::Util
+  {
+  public:
+    virtual ~Sink() {}
+
+    // layout : the main output, streams with codecpar and time_base final.
+    // packets come in those time bases.
+    virtual void open(const AVFormatContext* layout) = 0;
+
+    // packet is a reference of its own, the sink may keep it
+    virtual void write(ff::Packet& packet) = 0;
+
+    virtual void close() = 0;
+
+    virtual std::string name() const = 0;
+  };
+
+
+  // another container fed with the same encoded packets
+  // ex) MuxerSink("D:\\backup.mkv"), MuxerSink("udp://239.0.0.1:1234", "mpegts")
+  class MuxerSink : public Sink
+  {
+  private:
+    std::string filename_;
+    std::string format_name_;
+    AVFormatContext* ofmt_ctx_ = nullptr;
+    std::vector<AVRational> in_time_base_;
+    bool header_ = false;
+
+  public:
+    MuxerSink(const std::string& filename, const std::string& format_name = "")
+      : filename_(filename), format_name_(format_name)
+    {
+    }
+
+    ~MuxerSink()
+    {
+      free();
+    }
+
+    void open(const AVFormatContext* layout) override
+    {
+      chk(
+        avformat_alloc_output_context2(
+          &ofmt_ctx_, NULL,
+          format_name_.empty() ? NULL : format_name_.c_str(),
+          filename_.c_str()
+        ),
+        "sink avformat_alloc_output_context2 : %s", filename_.c_str()
+      );
+
+      in_time_base_.clear();
+      for (unsigned int i = 0; i < layout->nb_streams; i++) {
+        AVStream* in_stream = layout->streams[i];
+        AVStream* out_stream = avformat_new_stream(ofmt_ctx_, NULL);
+        chk(out_stream, "sink avformat_new_stream[stream: %u]", i);
+        chk(
+          avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar),
+          "sink avcodec_parameters_copy[stream: %u]", i
+        );
+        out_stream->codecpar->codec_tag = 0;
+        out_stream->time_base = in_stream->time_base;
+        in_time_base_.push_back(in_stream->time_base);
+      }
+
+      if (!(ofmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
+        chk(
+          avio_open(&ofmt_ctx_->pb, filename_.c_str(), AVIO_FLAG_WRITE),
+          "sink avio_open : %s", filename_.c_str()
+        );
+      }
+      chk(avformat_write_header(ofmt_ctx_, NULL), "sink avformat_write_header : %s", filename_.c_str());
+      header_ = true;
+    }
+
+    void write(ff::Packet& packet) override
+    {
+      unsigned int stream_index = packet->stream_index;
+      av_packet_rescale_ts(
+        packet,
+        in_time_base_[stream_index],
+        ofmt_ctx_->streams[stream_index]->time_base
+      );
+      chk(av_interleaved_write_frame(ofmt_ctx_, packet), "sink av_interleaved_write_frame : %s", filename_.c_str());
+    }
+
+    void close() override
+    {
+      int ret = 0;
+      if (header_) {
+        header_ = false;
+        ret = av_write_trailer(ofmt_ctx_);
+      }
+      free();
+      chk(ret, "sink av_write_trailer : %s", filename_.c_str());
+    }
+
+    std::string name() const override
+    {
+      return filename_;
+    }
+
+  private:
+    void free()
+    {
+      if (ofmt_ctx_ && !(ofmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&ofmt_ctx_->pb);
+      }
+      avformat_free_context(ofmt_ctx_);
+      ofmt_ctx_ = nullptr;
+    }
+  };
+
+
+  struct SinkStatus
+  {
+    std::string name;
+    bool failed = false;
+    std::string error;
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+  };
+
+
+  // one sink behind its own bounded queue and thread.
+  // push() never blocks : a full queue drops for this sink only, up to the
+  // stream's next keyframe. a failing sink is closed and left out, the
+  // capture and the other sinks go on.
+  class SinkRunner
+  {
+  private:
+    std::unique_ptr<Sink> sink_;
+    SpscQueue<ff::Packet> queue_;
+    std::vector<bool> wait_keyframe_; // producer only
+    std::thread thread_;
+    std::atomic<bool> running_{ false };
+    std::atomic<bool> failed_{ false };
+    mutable std::mutex err_mutex_;
+    std::string err_;
+    std::atomic<uint64_t> written_{ 0 };
+    std::atomic<uint64_t> dropped_{ 0 };
+
+  public:
+    SinkRunner(std::unique_ptr<Sink> sink, std::size_t queue_size)
+      : sink_(std::move(sink)), queue_(queue_size)
+    {
+    }
+
+    ~SinkRunner()
+    {
+      stop();
+    }
+
+    SinkRunner(const SinkRunner&) = delete;
+    SinkRunner& operator=(const SinkRunner&) = delete;
+
+    void start(const AVFormatContext* layout)
+    {
+      stop();
+      failed_ = false;
+      written_ = 0;
+      dropped_ = 0;
+      wait_keyframe_.assign(layout->nb_streams, false);
+
+      try {
+        sink_->open(layout);
+      } catch (std::runtime_error& e) {
+        fail(e.what());
+        close_sink();
+        return;
+      }
+
+      running_ = true;
+      thread_ = std::thread(&SinkRunner::run, this);
+    }
+
+    // producer (muxing thread). takes a new reference of packet.
+    void push(AVPacket* packet)
+    {
+      if (!running_ || failed_) {
+        return;
+      }
+
+      unsigned int stream_index = packet->stream_index;
+      if (stream_index < wait_keyframe_.size() && wait_keyframe_[stream_index]) {
+        if (!(packet->flags & AV_PKT_FLAG_KEY)) {
+          dropped_++;
+          return;
+        }
+        wait_keyframe_[stream_index] = false;
+      }
+
+      int ret = 0;
+      bool pushed = queue_.push_with([&](ff::Packet& slot) {
+        ret = av_packet_ref(slot, packet);
+      });
+      if (!pushed || ret < 0) {
+        dropped_++;
+        if (stream_index < wait_keyframe_.size()) {
+          wait_keyframe_[stream_index] = true;
+        }
+      }
+    }
+
+    // writes what is queued, then closes the sink
+    void stop()
+    {
+      running_ = false;
+      if (thread_.joinable()) {
+        thread_.join();
+      }
+    }
+
+    SinkStatus status() const
+    {
+      SinkStatus s;
+      s.name = sink_->name();
+      s.failed = failed_;
+      {
+        std::lock_guard<std::mutex> lock(err_mutex_);
+        s.error = err_;
+      }
+      s.written = written_;
+      s.dropped = dropped_;
+      return s;
+    }
+
+  private:
+    void run()
+    {
+      ff::Packet packet;
+      while (!failed_) {
+        if (queue_.pop(packet)) {
+          try {
+            if (packet->data) {
+              sink_->write(packet);
+              written_++;
+            }
+          } catch (std::runtime_error& e) {
+            fail(e.what());
+          }
+          packet.unref();
+          continue;
+        }
+        if (!running_) {
+          // producer is done : drained
+          if (queue_.empty()) {
+            break;
+          }
+          continue;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+      }
+
+      // failed : what is left is dropped
+      while (queue_.pop(packet)) {
+        packet.unref();
+        dropped_++;
+      }
+      close_sink();
+    }
+
+    void close_sink()
+    {
+      try {
+        sink_->close();
+      } catch (std::runtime_error& e) {
+        fail(e.what());
+      }
+    }
+
+    void fail(const char* what)
+    {
+      std::lock_guard<std::mutex> lock(err_mutex_);
+      if (!failed_) {
+        err_ = what;
+        failed_ = true;
+        av_log(nullptr, AV_LOG_ERROR, "sink %s failed : %s\n", sink_->name().c_str(), what);
+      }
+    }
+  };
+}
@@ -0,0 +1,91 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace ben {
+
+  // bounded lock-free queue for exactly one producer thread and one consumer thread.
+  // capacity is rounded up to a power of two.
+  template <typename T>
+  class SpscQueue
+  {
+  private:
+    static const std::size_t cache_line = 64;
+
+    std::vector<T> ring_;
+    std::size_t mask_ = 0;
+
+    // head_ : written by consumer, tail_ : written by producer.
+    // padded so the two indexes never share a cache line.
+    char pad0_[cache_line];
+    std::atomic<std::size_t> head_;
+    char pad1_[cache_line - sizeof(std::atomic<std::size_t>)];
+    std::atomic<std::size_t> tail_;
+    char pad2_[cache_line - sizeof(std::atomic<std::size_t>)];
+
+  public:
+    explicit SpscQueue(std::size_t capacity = 64)
+      : head_(0), tail_(0)
+    {
+      std::size_t size = 2;
+      while (size < capacity) {
+        size <<= 1;
+      }
+      ring_.resize(size);
+      mask_ = size - 1;
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // producer only. item is moved into the slot.
+    bool push(T& item)
+    {
+      return push_with([&item](T& slot) { slot = std::move(item); });
+    }
+
+    // producer only. fill(T& slot) writes the slot in place.
+    // slots are constructed once, so this never allocates.
+    template <typename Fill>
+    bool push_with(Fill fill)
+    {
+      std::size_t tail = tail_.load(std::memory_order_relaxed);
+      if (tail - head_.load(std::memory_order_acquire) > mask_) {
+        return false;
+      }
+      fill(ring_[tail & mask_]);
+      tail_.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    // consumer only. slot is moved into item.
+    bool pop(T& item)
+    {
+      std::size_t head = head_.load(std::memory_order_relaxed);
+      if (head == tail_.load(std::memory_order_acquire)) {
+        return false;
+      }
+      item = std::move(ring_[head & mask_]);
+      head_.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    std::size_t size() const
+    {
+      return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+      return size() == 0;
+    }
+
+    std::size_t capacity() const
+    {
+      return mask_ + 1;
+    }
+  };
+}
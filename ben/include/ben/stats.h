@@ -0,0 +1,312 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace ben {
+
+  // capture stages timed by Webcam
+  enum class Stage
+  {
+    Read,    // Input::read (av_read_frame)
+    Decode,  // avcodec_send_packet + avcodec_receive_frame
+    View,    // Viewer::view
+    Motion,  // MotionGate::update
+    Filter,  // av_buffersrc_add_frame_flags
+    Encode,  // avcodec_send_frame + avcodec_receive_packet
+    Write,   // av_interleaved_write_frame
+    Count
+  };
+
+  static const int stage_count = static_cast<int>(Stage::Count);
+
+  inline const char* stage_name(Stage stage)
+  {
+    switch (stage) {
+    case Stage::Read: return "read";
+    case Stage::Decode: return "decode";
+    case Stage::View: return "view";
+    case Stage::Motion: return "motion";
+    case Stage::Filter: return "filter";
+    case Stage::Encode: return "encode";
+    case Stage::Write: return "write";
+    default: return "unknown";
+    }
+  }
+
+
+  // lock-free log-linear histogram of microseconds.
+  // 8 sub buckets per power of two (about 12% resolution), up to ~2^40 us.
+  // record() is wait-free. meant to be written by the thread running the stage,
+  // read by anyone.
+  // one per stage instead of one per thread : a stage runs on one thread at a
+  // time (pipeline thread, the serial caller or one pool task per camera), so
+  // the relaxed adds stay uncontended. only encode/write are shared with the
+  // rendition threads, a few adds per frame. snapshots need no merging.
+  class Histogram
+  {
+  private:
+    static const int sub_bits = 3;
+    static const int sub_count = 1 << sub_bits;
+    static const int bucket_count = (40 - sub_bits + 1) * sub_count;
+
+    std::atomic<uint64_t> buckets_[bucket_count];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+
+  public:
+    Histogram()
+    {
+      reset();
+    }
+
+    void reset()
+    {
+      for (auto& bucket : buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+      count_.store(0, std::memory_order_relaxed);
+      sum_.store(0, std::memory_order_relaxed);
+      max_.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t us)
+    {
+      buckets_[index(us)].fetch_add(1, std::memory_order_relaxed);
+      count_.fetch_add(1, std::memory_order_relaxed);
+      sum_.fetch_add(us, std::memory_order_relaxed);
+
+      uint64_t max = max_.load(std::memory_order_relaxed);
+      while (us > max && !max_.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+      }
+    }
+
+    // adds the samples of other (aggregating several sources)
+    void add(const Histogram& other)
+    {
+      for (int i = 0; i < bucket_count; i++) {
+        buckets_[i].fetch_add(other.buckets_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+      }
+      count_.fetch_add(other.count(), std::memory_order_relaxed);
+      sum_.fetch_add(other.sum_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+      uint64_t other_max = other.max();
+      uint64_t max = max_.load(std::memory_order_relaxed);
+      while (other_max > max && !max_.compare_exchange_weak(max, other_max, std::memory_order_relaxed)) {
+      }
+    }
+
+    uint64_t count() const
+    {
+      return count_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const
+    {
+      return max_.load(std::memory_order_relaxed);
+    }
+
+    double mean() const
+    {
+      uint64_t count = this->count();
+      return count ? static_cast<double>(sum_.load(std::memory_order_relaxed)) / count : 0;
+    }
+
+    // upper bound of the bucket holding the p-th value (p : 0 ~ 1), clamped to max
+    uint64_t percentile(double p) const
+    {
+      uint64_t total = 0;
+      uint64_t counts[bucket_count];
+      for (int i = 0; i < bucket_count; i++) {
+        counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        total += counts[i];
+      }
+      if (total == 0) {
+        return 0;
+      }
+
+      uint64_t rank = static_cast<uint64_t>(p * (total - 1)) + 1;
+      uint64_t seen = 0;
+      for (int i = 0; i < bucket_count; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+          uint64_t upper = upper_bound(i);
+          uint64_t max = this->max();
+          return upper < max ? upper : max;
+        }
+      }
+      return max();
+    }
+
+  private:
+    static int index(uint64_t us)
+    {
+      if (us < sub_count) {
+        return static_cast<int>(us);
+      }
+      int msb = 63;
+      while (!(us >> msb)) {
+        msb--;
+      }
+      if (msb >= 40) {
+        return bucket_count - 1;
+      }
+      int sub = static_cast<int>((us >> (msb - sub_bits)) & (sub_count - 1));
+      return (msb - sub_bits + 1) * sub_count + sub;
+    }
+
+    static uint64_t upper_bound(int index)
+    {
+      if (index < sub_count) {
+        return index;
+      }
+      int msb = index / sub_count + sub_bits - 1;
+      uint64_t sub = index % sub_count;
+      return ((sub_count + sub + 1) << (msb - sub_bits)) - 1;
+    }
+  };
+
+
+  // times a scope into a histogram. null histogram : does nothing.
+  // pause()/resume() leave out work that belongs to another stage.
+  class StageTimer
+  {
+  private:
+    Histogram* histogram_;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::steady_clock::duration elapsed_{ 0 };
+    bool running_ = false;
+
+  public:
+    explicit StageTimer(Histogram* histogram)
+      : histogram_(histogram)
+    {
+      resume();
+    }
+
+    ~StageTimer()
+    {
+      if (histogram_) {
+        pause();
+        histogram_->record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed_).count());
+      }
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    void pause()
+    {
+      if (histogram_ && running_) {
+        elapsed_ += std::chrono::steady_clock::now() - start_;
+        running_ = false;
+      }
+    }
+
+    void resume()
+    {
+      if (histogram_ && !running_) {
+        start_ = std::chrono::steady_clock::now();
+        running_ = true;
+      }
+    }
+  };
+
+
+  // snapshot returned by Webcam::stats()
+  struct StageStats
+  {
+    uint64_t count = 0;
+    uint64_t p50_us = 0;
+    uint64_t p99_us = 0;
+    uint64_t max_us = 0;
+    double mean_us = 0;
+  };
+
+  struct CaptureStats
+  {
+    StageStats stages[stage_count];
+    uint64_t frames_in = 0;
+    uint64_t frames_out = 0;
+    uint64_t frames_dropped = 0;
+    uint64_t frames_skipped = 0; // decoded, not encoded (motion gate idle)
+
+    const StageStats& stage(Stage stage) const
+    {
+      return stages[static_cast<int>(stage)];
+    }
+  };
+
+
+  // histograms and counters one Webcam writes to
+  class StatsCollector
+  {
+  private:
+    bool enabled_ = true;
+    Histogram stages_[stage_count];
+    std::atomic<uint64_t> frames_in_{ 0 };
+    std::atomic<uint64_t> frames_out_{ 0 };
+    std::atomic<uint64_t> frames_dropped_{ 0 };
+    std::atomic<uint64_t> frames_skipped_{ 0 };
+
+  public:
+    void set_enabled(bool enabled)
+    {
+      enabled_ = enabled;
+    }
+
+    // null when disabled, so StageTimer skips the clock
+    Histogram* stage(Stage stage)
+    {
+      return enabled_ ? &stages_[static_cast<int>(stage)] : nullptr;
+    }
+
+    void frame_in() { frames_in_.fetch_add(1, std::memory_order_relaxed); }
+    void frame_out() { frames_out_.fetch_add(1, std::memory_order_relaxed); }
+    void frame_dropped(uint64_t n = 1) { frames_dropped_.fetch_add(n, std::memory_order_relaxed); }
+    void frame_skipped(uint64_t n = 1) { frames_skipped_.fetch_add(n, std::memory_order_relaxed); }
+
+    void reset()
+    {
+      for (auto& h : stages_) {
+        h.reset();
+      }
+      frames_in_ = 0;
+      frames_out_ = 0;
+      frames_dropped_ = 0;
+      frames_skipped_ = 0;
+    }
+
+    // sums into total, percentiles of the total are over every sample
+    void add_to(StatsCollector& total) const
+    {
+      for (int i = 0; i < stage_count; i++) {
+        total.stages_[i].add(stages_[i]);
+      }
+      total.frames_in_ += frames_in_.load(std::memory_order_relaxed);
+      total.frames_out_ += frames_out_.load(std::memory_order_relaxed);
+      total.frames_dropped_ += frames_dropped_.load(std::memory_order_relaxed);
+      total.frames_skipped_ += frames_skipped_.load(std::memory_order_relaxed);
+    }
+
+    CaptureStats snapshot() const
+    {
+      CaptureStats s;
+      for (int i = 0; i < stage_count; i++) {
+        const Histogram& h = stages_[i];
+        s.stages[i].count = h.count();
+        s.stages[i].p50_us = h.percentile(0.50);
+        s.stages[i].p99_us = h.percentile(0.99);
+        s.stages[i].max_us = h.max();
+        s.stages[i].mean_us = h.mean();
+      }
+      s.frames_in = frames_in_.load(std::memory_order_relaxed);
+      s.frames_out = frames_out_.load(std::memory_order_relaxed);
+      s.frames_dropped = frames_dropped_.load(std::memory_order_relaxed);
+      s.frames_skipped = frames_skipped_.load(std::memory_order_relaxed);
+      return s;
+    }
+  };
+}
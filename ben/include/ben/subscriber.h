@@ -0,0 +1,508 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ffmpeg.h"
+#include "scaler.h"
+#include "spsc_queue.h"
+
+namespace ben {
+
+  // what a subscriber wants to get. defaults : the frames as decoded.
+  // width or height 0 : from the other one and the aspect ratio, both 0 : decoded size.
+  // converted by SliceScaler : on a few cores when the heights fit it (1080 -> 720,
+  // 1080 -> 480 ...), on one otherwise. SubscriberStatus::convert_slices tells.
+  struct FrameFormat
+  {
+    AVPixelFormat pix_fmt = AV_PIX_FMT_NONE; // none : decoded format
+    int width = 0;
+    int height = 0;
+    int sws_flags = SWS_BILINEAR;
+
+    bool native() const
+    {
+      return pix_fmt == AV_PIX_FMT_NONE && width == 0 && height == 0;
+    }
+
+    bool operator==(const FrameFormat& other) const
+    {
+      return
+        pix_fmt == other.pix_fmt &&
+        width == other.width &&
+        height == other.height &&
+        sws_flags == other.sws_flags;
+    }
+  };
+
+
+  // consumer of decoded video frames (analytics, detection ...).
+  // every method runs on the subscriber's own thread, so a slow subscriber only
+  // misses frames itself. open(), on_frame() and close() may throw std::runtime_error.
+  class FrameSubscriber : public ff::Util
+  {
+  public:
+    virtual ~FrameSubscriber() {}
+
+    // pts of the frames are in time_base
+    virtual void open(AVRational time_base) {}
+
+    // frame is a reference of its own, the subscriber may keep it.
+    // buffers are shared with the encoder and other subscribers : read only.
+    virtual void on_frame(ff::Frame& frame) = 0;
+
+    virtual void close() {}
+
+    virtual std::string name() const = 0;
+  };
+
+
+  // subscriber from a function
+  // ex) wc.subscribe(std::unique_ptr<FrameSubscriber>(new CallbackSubscriber("detect", [](ben::ff::Frame& frame) { ... })), bgr);
+  class CallbackSubscriber : public FrameSubscriber
+  {
+  private:
+    std::string name_;
+    std::function<void(ff::Frame&)> callback_;
+
+  public:
+    CallbackSubscriber(const std::string& name, std::function<void(ff::Frame&)> callback)
+      : name_(name), callback_(callback)
+    {
+    }
+
+    void on_frame(ff::Frame& frame) override
+    {
+      callback_(frame);
+    }
+
+    std::string name() const override
+    {
+      return name_;
+    }
+  };
+
+
+  struct SubscriberStatus
+  {
+    std::string name;
+    bool failed = false;
+    std::string error;
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+    std::size_t convert_slices = 0; // converter SliceScaler slices, 1 : one core, 0 : native
+  };
+
+
+  // one subscriber behind its own bounded queue and thread.
+  // push() never blocks : a full queue drops the frame for this subscriber only.
+  // a failing subscriber is closed and left out, the capture goes on.
+  class SubscriberRunner
+  {
+  private:
+    std::unique_ptr<FrameSubscriber> subscriber_;
+    SpscQueue<ff::Frame> queue_;
+    std::thread thread_;
+    std::atomic<bool> running_{ false };
+    std::atomic<bool> failed_{ false };
+    mutable std::mutex err_mutex_;
+    std::string err_;
+    std::atomic<uint64_t> delivered_{ 0 };
+    std::atomic<uint64_t> dropped_{ 0 };
+
+  public:
+    SubscriberRunner(std::unique_ptr<FrameSubscriber> subscriber, std::size_t queue_size)
+      : subscriber_(std::move(subscriber)), queue_(queue_size)
+    {
+    }
+
+    ~SubscriberRunner()
+    {
+      stop();
+    }
+
+    SubscriberRunner(const SubscriberRunner&) = delete;
+    SubscriberRunner& operator=(const SubscriberRunner&) = delete;
+
+    void start(AVRational time_base)
+    {
+      stop();
+      failed_ = false;
+      delivered_ = 0;
+      dropped_ = 0;
+
+      try {
+        subscriber_->open(time_base);
+      } catch (std::runtime_error& e) {
+        fail(e.what());
+        close_subscriber();
+        return;
+      }
+
+      running_ = true;
+      thread_ = std::thread(&SubscriberRunner::run, this);
+    }
+
+    bool active() const
+    {
+      return running_ && !failed_;
+    }
+
+    // producer only : room for one more frame
+    bool ready() const
+    {
+      return active() && queue_.size() < queue_.capacity();
+    }
+
+    // producer (decoding thread or a FrameConverter). takes a new reference of frame.
+    void push(const AVFrame* frame)
+    {
+      if (!active()) {
+        return;
+      }
+
+      int ret = 0;
+      bool pushed = queue_.push_with([&](ff::Frame& slot) {
+        ret = av_frame_ref(slot, frame);
+      });
+      if (!pushed || ret < 0) {
+        dropped_++;
+      }
+    }
+
+    // a frame that never made it to push()
+    void drop()
+    {
+      if (active()) {
+        dropped_++;
+      }
+    }
+
+    // delivers what is queued, then closes the subscriber
+    void stop()
+    {
+      running_ = false;
+      if (thread_.joinable()) {
+        thread_.join();
+      }
+    }
+
+    void fail(const char* what)
+    {
+      std::lock_guard<std::mutex> lock(err_mutex_);
+      if (!failed_) {
+        err_ = what;
+        failed_ = true;
+        av_log(nullptr, AV_LOG_ERROR, "subscriber %s failed : %s\n", subscriber_->name().c_str(), what);
+      }
+    }
+
+    SubscriberStatus status() const
+    {
+      SubscriberStatus s;
+      s.name = subscriber_->name();
+      s.failed = failed_;
+      {
+        std::lock_guard<std::mutex> lock(err_mutex_);
+        s.error = err_;
+      }
+      s.delivered = delivered_;
+      s.dropped = dropped_;
+      return s;
+    }
+
+  private:
+    void run()
+    {
+      ff::Frame frame;
+      while (!failed_) {
+        if (queue_.pop(frame)) {
+          try {
+            subscriber_->on_frame(frame);
+            delivered_++;
+          } catch (std::runtime_error& e) {
+            fail(e.what());
+          }
+          frame.unref();
+          continue;
+        }
+        if (!running_) {
+          // producer is done : drained
+          if (queue_.empty()) {
+            break;
+          }
+          continue;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+      }
+
+      // failed : what is left is dropped
+      while (queue_.pop(frame)) {
+        frame.unref();
+        dropped_++;
+      }
+      close_subscriber();
+    }
+
+    void close_subscriber()
+    {
+      try {
+        subscriber_->close();
+      } catch (std::runtime_error& e) {
+        fail(e.what());
+      }
+    }
+  };
+
+
+  // subscribers sharing one FrameFormat : every frame is converted once on this
+  // thread, then each subscriber gets a reference of the same converted frame.
+  // frames nobody has room for are not converted at all.
+  class FrameConverter : public ff::Util
+  {
+  private:
+    FrameFormat format_;
+    std::vector<SubscriberRunner*> subscribers_;
+    SpscQueue<ff::Frame> queue_;
+    SliceScaler scaler_;
+    ff::BufferPool pool_;
+    std::thread thread_;
+    std::atomic<bool> running_{ false };
+
+  public:
+    FrameConverter(const FrameFormat& format)
+      : format_(format), queue_(2), scaler_(0, format.sws_flags)
+    {
+    }
+
+    ~FrameConverter()
+    {
+      stop();
+    }
+
+    FrameConverter(const FrameConverter&) = delete;
+    FrameConverter& operator=(const FrameConverter&) = delete;
+
+    const FrameFormat& format() const
+    {
+      return format_;
+    }
+
+    // before start
+    void add(SubscriberRunner* subscriber)
+    {
+      subscribers_.push_back(subscriber);
+    }
+
+    bool feeds(const SubscriberRunner* subscriber) const
+    {
+      return std::find(subscribers_.begin(), subscribers_.end(), subscriber) != subscribers_.end();
+    }
+
+    // any thread
+    std::size_t slices() const
+    {
+      return scaler_.slices();
+    }
+
+    // after the subscribers started
+    void start()
+    {
+      stop();
+      running_ = true;
+      thread_ = std::thread(&FrameConverter::run, this);
+    }
+
+    // producer (decoding thread). takes a new reference of frame.
+    void push(const AVFrame* frame)
+    {
+      if (!running_) {
+        return;
+      }
+
+      bool wanted = false;
+      for (auto subscriber : subscribers_) {
+        wanted = wanted || subscriber->ready();
+      }
+      if (!wanted) {
+        drop();
+        return;
+      }
+
+      int ret = 0;
+      bool pushed = queue_.push_with([&](ff::Frame& slot) {
+        ret = av_frame_ref(slot, frame);
+      });
+      if (!pushed || ret < 0) {
+        drop();
+      }
+    }
+
+    // converts what is queued, then stops. the subscribers are stopped by the caller.
+    void stop()
+    {
+      running_ = false;
+      if (thread_.joinable()) {
+        thread_.join();
+      }
+    }
+
+  private:
+    void drop()
+    {
+      for (auto subscriber : subscribers_) {
+        subscriber->drop();
+      }
+    }
+
+    void run()
+    {
+      ff::Frame frame;
+      ff::Frame converted;
+      while (true) {
+        if (queue_.pop(frame)) {
+          convert(frame, converted);
+          frame.unref();
+          continue;
+        }
+        if (!running_) {
+          if (queue_.empty()) {
+            break;
+          }
+          continue;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+      }
+    }
+
+    void convert(ff::Frame& frame, ff::Frame& converted)
+    {
+      AVPixelFormat pix_fmt = format_.pix_fmt != AV_PIX_FMT_NONE
+        ? format_.pix_fmt
+        : static_cast<AVPixelFormat>(frame->format);
+      int width = format_.width;
+      int height = format_.height;
+      if (!width && !height) {
+        width = frame->width;
+        height = frame->height;
+      } else if (!width) {
+        width = static_cast<int>(av_rescale(frame->width, height, frame->height)) & ~1;
+      } else if (!height) {
+        height = static_cast<int>(av_rescale(frame->height, width, frame->width)) & ~1;
+      }
+
+      try {
+        // pooled : no allocation once every subscriber let its frames go
+        chk(converted.get_buffer(pool_, pix_fmt, width, height, ff::Frame::simd_align), "subscriber frame buffer");
+        ff::Frame::copy_props(frame, converted);
+        scaler_.scale(frame, converted);
+      } catch (std::runtime_error& e) {
+        // the same frame size and format fails every time : give up on the group
+        for (auto subscriber : subscribers_) {
+          subscriber->fail(e.what());
+        }
+        converted.unref();
+        return;
+      }
+
+      for (auto subscriber : subscribers_) {
+        subscriber->push(converted);
+      }
+      converted.unref();
+    }
+  };
+
+
+  // decoded frames of one stream to every subscriber, converted once per FrameFormat
+  class FrameHub
+  {
+  private:
+    std::vector<std::unique_ptr<SubscriberRunner>> subscribers_;
+    std::vector<SubscriberRunner*> native_;
+    std::vector<std::unique_ptr<FrameConverter>> converters_;
+
+  public:
+    FrameHub() {}
+
+    FrameHub(const FrameHub&) = delete;
+    FrameHub& operator=(const FrameHub&) = delete;
+
+    bool empty() const
+    {
+      return subscribers_.empty();
+    }
+
+    // before start
+    void add(std::unique_ptr<FrameSubscriber> subscriber, const FrameFormat& format, std::size_t queue_size)
+    {
+      SubscriberRunner* runner = new SubscriberRunner(std::move(subscriber), queue_size);
+      subscribers_.emplace_back(runner);
+
+      if (format.native()) {
+        native_.push_back(runner);
+        return;
+      }
+      for (auto& converter : converters_) {
+        if (converter->format() == format) {
+          converter->add(runner);
+          return;
+        }
+      }
+      converters_.emplace_back(new FrameConverter(format));
+      converters_.back()->add(runner);
+    }
+
+    void start(AVRational time_base)
+    {
+      for (auto& subscriber : subscribers_) {
+        subscriber->start(time_base);
+      }
+      for (auto& converter : converters_) {
+        converter->start();
+      }
+    }
+
+    // decoding thread. never blocks on a subscriber.
+    void publish(const AVFrame* frame)
+    {
+      for (auto subscriber : native_) {
+        subscriber->push(frame);
+      }
+      for (auto& converter : converters_) {
+        converter->push(frame);
+      }
+    }
+
+    // converters finish first, they still feed their subscribers
+    void stop()
+    {
+      for (auto& converter : converters_) {
+        converter->stop();
+      }
+      for (auto& subscriber : subscribers_) {
+        subscriber->stop();
+      }
+    }
+
+    std::vector<SubscriberStatus> status() const
+    {
+      std::vector<SubscriberStatus> status;
+      for (auto& subscriber : subscribers_) {
+        SubscriberStatus s = subscriber->status();
+        for (auto& converter : converters_) {
+          if (converter->feeds(subscriber.get())) {
+            s.convert_slices = converter->slices();
+          }
+        }
+        status.push_back(s);
+      }
+      return status;
+    }
+  };
+}
@@ -0,0 +1,314 @@
+﻿#pragma once
+
+#if defined(__linux__)
+
+#include <atomic>
+#include <cerrno>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include "input.h"
+
+namespace ben {
+
+  // V4L2 capture device with mmap'd streaming buffers.
+  // a dequeued driver buffer becomes the packet data itself (zero copy) and
+  // goes back to the driver when the last reference to that packet is released.
+  class V4l2Input : public Input
+  {
+  private:
+    struct Device;
+
+    struct Slot
+    {
+      Device* device = nullptr;
+      uint32_t index = 0;
+      uint8_t* start = nullptr;
+      size_t length = 0;
+    };
+
+    // shared by the input and every packet still holding a driver buffer
+    struct Device
+    {
+      int fd = -1;
+      std::vector<Slot> slots;
+      std::atomic<int> refs{ 1 };
+      std::atomic<int> queued{ 0 };
+      std::atomic<bool> streaming{ false };
+
+      bool queue(uint32_t index)
+      {
+        if (!streaming) {
+          return false;
+        }
+        v4l2_buffer buf = {};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = index;
+        if (xioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+          return false;
+        }
+        queued++;
+        return true;
+      }
+
+      void release()
+      {
+        if (--refs > 0) {
+          return;
+        }
+        for (auto& slot : slots) {
+          if (slot.start) {
+            munmap(slot.start, slot.length);
+          }
+        }
+        if (fd >= 0) {
+          ::close(fd);
+        }
+        delete this;
+      }
+    };
+
+    std::string device_name_;
+    int width_;
+    int height_;
+    int fps_;
+    uint32_t pixel_format_;
+    unsigned int buffer_count_ = 8;
+
+    Device* device_ = nullptr;
+    AVFormatContext* ifmt_ctx_ = nullptr;
+    ff::BufferPool pool_;
+
+  public:
+    // pixel_format : V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_YUYV ...
+    V4l2Input(
+      const std::string& device_name = "/dev/video0",
+      int width = 1280,
+      int height = 720,
+      int fps = 30,
+      uint32_t pixel_format = V4L2_PIX_FMT_MJPEG
+    )
+      : device_name_(device_name), width_(width), height_(height),
+        fps_(fps), pixel_format_(pixel_format)
+    {
+    }
+
+    ~V4l2Input()
+    {
+      close();
+    }
+
+    // driver buffers. more buffers let the pipeline hold more frames without copying.
+    void set_buffer_count(unsigned int buffer_count)
+    {
+      buffer_count_ = buffer_count;
+    }
+
+    void open() override
+    {
+      device_ = new Device();
+      device_->fd = ::open(device_name_.c_str(), O_RDWR);
+      chk(device_->fd < 0 ? AVERROR(errno) : 0, "v4l2 open : %s", device_name_.c_str());
+
+      v4l2_capability cap = {};
+      chk(xioctl(device_->fd, VIDIOC_QUERYCAP, &cap), "v4l2 VIDIOC_QUERYCAP");
+      if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) || !(cap.capabilities & V4L2_CAP_STREAMING)) {
+        chk(AVERROR(ENODEV), "v4l2 no streaming capture : %s", device_name_.c_str());
+      }
+
+      v4l2_format fmt = {};
+      fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      fmt.fmt.pix.width = width_;
+      fmt.fmt.pix.height = height_;
+      fmt.fmt.pix.pixelformat = pixel_format_;
+      fmt.fmt.pix.field = V4L2_FIELD_ANY;
+      chk(xioctl(device_->fd, VIDIOC_S_FMT, &fmt), "v4l2 VIDIOC_S_FMT");
+
+      // driver may adjust
+      width_ = fmt.fmt.pix.width;
+      height_ = fmt.fmt.pix.height;
+      pixel_format_ = fmt.fmt.pix.pixelformat;
+
+      v4l2_streamparm parm = {};
+      parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      parm.parm.capture.timeperframe.numerator = 1;
+      parm.parm.capture.timeperframe.denominator = fps_;
+      if (xioctl(device_->fd, VIDIOC_S_PARM, &parm) >= 0 && parm.parm.capture.timeperframe.numerator) {
+        fps_ = parm.parm.capture.timeperframe.denominator / parm.parm.capture.timeperframe.numerator;
+      }
+
+      v4l2_requestbuffers req = {};
+      req.count = buffer_count_;
+      req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      req.memory = V4L2_MEMORY_MMAP;
+      chk(xioctl(device_->fd, VIDIOC_REQBUFS, &req), "v4l2 VIDIOC_REQBUFS");
+      chk(req.count < 2 ? AVERROR(ENOMEM) : 0, "v4l2 not enough buffers");
+
+      device_->slots.resize(req.count);
+      for (uint32_t i = 0; i < req.count; i++) {
+        v4l2_buffer buf = {};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        chk(xioctl(device_->fd, VIDIOC_QUERYBUF, &buf), "v4l2 VIDIOC_QUERYBUF[%u]", i);
+
+        void* start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, device_->fd, buf.m.offset);
+        chk(start == MAP_FAILED ? AVERROR(errno) : 0, "v4l2 mmap[%u]", i);
+
+        Slot& slot = device_->slots[i];
+        slot.device = device_;
+        slot.index = i;
+        slot.start = static_cast<uint8_t*>(start);
+        slot.length = buf.length;
+      }
+
+      device_->streaming = true;
+      for (uint32_t i = 0; i < req.count; i++) {
+        chk(device_->queue(i) ? 0 : AVERROR(errno), "v4l2 VIDIOC_QBUF[%u]", i);
+      }
+
+      v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      chk(xioctl(device_->fd, VIDIOC_STREAMON, &type), "v4l2 VIDIOC_STREAMON");
+
+      open_format_context();
+    }
+
+    AVFormatContext* format_context() override
+    {
+      return ifmt_ctx_;
+    }
+
+    int read(ff::Packet& packet) override
+    {
+      v4l2_buffer buf = {};
+      buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buf.memory = V4L2_MEMORY_MMAP;
+      int ret = xioctl(device_->fd, VIDIOC_DQBUF, &buf);
+      if (ret < 0) {
+        return ret;
+      }
+      device_->queued--;
+
+      Slot& slot = device_->slots[buf.index];
+      bool raw = pixel_format_ != V4L2_PIX_FMT_MJPEG;
+
+      packet.unref();
+      packet->data = slot.start;
+      packet->size = buf.bytesused;
+      packet->stream_index = 0;
+      packet->flags |= AV_PKT_FLAG_KEY;
+      packet->pts = packet->dts = buf.timestamp.tv_sec * 1000000LL + buf.timestamp.tv_usec;
+
+      // keep at least two buffers with the driver, and compressed data needs
+      // zeroed input padding after it. otherwise copy and give the buffer back now.
+      bool padded = raw || buf.bytesused + AV_INPUT_BUFFER_PADDING_SIZE <= slot.length;
+      if (device_->queued < 2 || !padded) {
+        ret = packet.make_refcounted(pool_);
+        device_->queue(buf.index);
+        return ret;
+      }
+
+      if (!raw) {
+        memset(slot.start + buf.bytesused, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+      }
+
+      device_->refs++;
+      packet->buf = av_buffer_create(slot.start, buf.bytesused, V4l2Input::release_buffer, &slot, 0);
+      if (!packet->buf) {
+        device_->refs--;
+        device_->queue(buf.index);
+        packet->data = nullptr;
+        packet->size = 0;
+        return AVERROR(ENOMEM);
+      }
+      return 0;
+    }
+
+    void close() override
+    {
+      if (device_) {
+        if (device_->streaming) {
+          device_->streaming = false;
+          v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+          xioctl(device_->fd, VIDIOC_STREAMOFF, &type);
+        }
+        // unmapped when the last outstanding packet is released
+        device_->release();
+        device_ = nullptr;
+      }
+      avformat_free_context(ifmt_ctx_);
+      ifmt_ctx_ = nullptr;
+    }
+
+    std::string name() const override
+    {
+      return "v4l2:" + device_name_;
+    }
+
+  private:
+    // no demuxer : describe the single video stream ourselves
+    void open_format_context()
+    {
+      ifmt_ctx_ = avformat_alloc_context();
+      chk(ifmt_ctx_, "v4l2 avformat_alloc_context");
+
+      AVStream* stream = avformat_new_stream(ifmt_ctx_, NULL);
+      chk(stream, "v4l2 avformat_new_stream");
+
+      stream->time_base = AVRational{ 1, 1000000 };
+      stream->avg_frame_rate = AVRational{ fps_, 1 };
+      stream->r_frame_rate = AVRational{ fps_, 1 };
+
+      AVCodecParameters* par = stream->codecpar;
+      par->codec_type = AVMEDIA_TYPE_VIDEO;
+      par->width = width_;
+      par->height = height_;
+
+      switch (pixel_format_) {
+      case V4L2_PIX_FMT_MJPEG:
+        par->codec_id = AV_CODEC_ID_MJPEG;
+        break;
+      case V4L2_PIX_FMT_YUYV:
+        par->codec_id = AV_CODEC_ID_RAWVIDEO;
+        par->format = AV_PIX_FMT_YUYV422;
+        break;
+      case V4L2_PIX_FMT_NV12:
+        par->codec_id = AV_CODEC_ID_RAWVIDEO;
+        par->format = AV_PIX_FMT_NV12;
+        break;
+      case V4L2_PIX_FMT_YUV420:
+        par->codec_id = AV_CODEC_ID_RAWVIDEO;
+        par->format = AV_PIX_FMT_YUV420P;
+        break;
+      default:
+        chk(AVERROR_INVALIDDATA, "v4l2 unsupported pixel format 0x%08x", pixel_format_);
+      }
+    }
+
+    static void release_buffer(void* opaque, uint8_t* data)
+    {
+      Slot* slot = static_cast<Slot*>(opaque);
+      Device* device = slot->device;
+      device->queue(slot->index);
+      device->release();
+    }
+
+    static int xioctl(int fd, unsigned long request, void* arg)
+    {
+      int ret = 0;
+      do {
+        ret = ioctl(fd, request, arg);
+      } while (ret < 0 && errno == EINTR);
+      return ret < 0 ? AVERROR(errno) : ret;
+    }
+  };
+}
+
+#endif
@@ -1,106 +1,146 @@
 ﻿#pragma once
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
 #include "ffmpeg.h"
 #include "opencv.h"
+#include "scaler.h"
 
 
 namespace ben {
 
+  // shows video frames on its own render thread.
+  // view() only hands the frame over (latest frame wins), so a slow window
+  // never holds back the capture loop. frames that are replaced before
+  // the next refresh are never converted.
   class Viewer : public ff::Util
   {
   private:
-    uint8_t* buffer_ = nullptr;
+    ff::BufferPool pool_;
     ff::Frame frame_rgb_;
 
+    // YuvToBgr or swscale, in slices (4k keeps up). same size : no filter taps needed
+    SliceScaler scaler_{ 0, SWS_POINT };
+
+    // mailbox : written by view(), taken by the render thread
+    std::mutex mailbox_mutex_;
+    ff::Frame mailbox_;
+    bool mailbox_full_ = false;
+
+    ff::Frame render_frame_;
+    std::thread render_thread_;
+    std::atomic<bool> running_{ false };
+    int refresh_rate_ = 60;
+
   public:
     Viewer() {}
 
     ~Viewer()
     {
-      if (buffer_) {
-        av_free(buffer_);
-        buffer_ = nullptr;
-      }
+      close();
     }
 
+    // cap of rendered frames per second (display refresh rate)
+    void set_refresh_rate(int refresh_rate)
+    {
+      if (refresh_rate > 0) {
+        refresh_rate_ = refresh_rate;
+      }
+    }
 
     void init(AVCodecContext* dec_ctx)
     {
-      AVPixelFormat pixel_format = AV_PIX_FMT_BGR24;
+      alloc_buffer(dec_ctx->width, dec_ctx->height);
 
-      int bytes = av_image_get_buffer_size(
-        pixel_format,
-        dec_ctx->width,
-        dec_ctx->height,
-        1
-      );
+      if (!running_) {
+        running_ = true;
+        render_thread_ = std::thread(&Viewer::render, this);
+      }
+    }
 
-      buffer_ = (uint8_t*)av_malloc(bytes * sizeof(uint8_t));
+    void view(AVCodecContext* dec_ctx, ff::Frame& frame)
+    {
+      std::lock_guard<std::mutex> lock(mailbox_mutex_);
+      av_frame_unref(mailbox_);
+      mailbox_full_ = av_frame_ref(mailbox_, frame) >= 0;
+    }
 
-      chk(
-        av_image_fill_arrays(
-          frame_rgb_->data,
-          frame_rgb_->linesize,
-          buffer_,
-          pixel_format,
-          dec_ctx->width,
-          dec_ctx->height,
-          1),
-        "viewer av_image_fill_arrays"
-      );
+    void close()
+    {
+      running_ = false;
+      if (render_thread_.joinable()) {
+        render_thread_.join();
+      }
+
+      frame_rgb_.unref();
     }
 
-    void view(AVCodecContext* dec_ctx, ff::Frame& frame)
+  private:
+    void render()
     {
-      AVPixelFormat pix_fmt = dec_ctx->pix_fmt;
-      switch (pix_fmt) {
-      case AV_PIX_FMT_YUVJ420P: pix_fmt = AV_PIX_FMT_YUV420P; break;
-      case AV_PIX_FMT_YUVJ422P: pix_fmt = AV_PIX_FMT_YUV422P; break;
-      case AV_PIX_FMT_YUVJ444P: pix_fmt = AV_PIX_FMT_YUV444P; break;
-      case AV_PIX_FMT_YUVJ440P: pix_fmt = AV_PIX_FMT_YUV440P; break;
-      default: break;
+      auto interval = std::chrono::microseconds(1000000 / refresh_rate_);
+      auto next = std::chrono::steady_clock::now();
+
+      while (running_) {
+        next += interval;
+
+        bool have_frame = false;
+        {
+          std::lock_guard<std::mutex> lock(mailbox_mutex_);
+          if (mailbox_full_) {
+            av_frame_unref(render_frame_);
+            av_frame_move_ref(render_frame_, mailbox_);
+            mailbox_full_ = false;
+            have_frame = true;
+          }
+        }
+
+        if (have_frame) {
+          try {
+            show(render_frame_);
+          } catch (std::runtime_error& e) {
+            // preview only. never stop the capture for it.
+            printf("viewer : %s\n", e.what());
+          }
+          av_frame_unref(render_frame_);
+        }
+
+        // keep the window responsive even without new frames
+        cvWaitKey(1);
+
+        auto now = std::chrono::steady_clock::now();
+        if (next > now) {
+          std::this_thread::sleep_for(next - now);
+        } else {
+          next = now;
+        }
       }
+    }
 
-      struct SwsContext* img_convert_ctx = sws_getCachedContext(
-        NULL,
-        dec_ctx->width,
-        dec_ctx->height,
-        pix_fmt,
-        dec_ctx->width,
-        dec_ctx->height,
-        AV_PIX_FMT_BGR24,
-        SWS_BICUBIC, NULL, NULL, NULL
-      );
-      chk(img_convert_ctx, "viewer sws_getCachedContext");
-
-      sws_scale(
-        img_convert_ctx,
-        frame->data,
-        frame->linesize,
-        0,
-        dec_ctx->height,
-        frame_rgb_->data,
-        frame_rgb_->linesize
-      );
+    void show(ff::Frame& frame)
+    {
+      alloc_buffer(frame->width, frame->height);
 
-      //OpenCV
-      cv::Mat img(
-        frame->height,
-        frame->width,
-        CV_8UC3,
-        frame_rgb_->data[0]
-      );
-      cv::imshow("display", img);
-      cvWaitKey(1);
+      scaler_.scale(frame, frame_rgb_);
 
-      sws_freeContext(img_convert_ctx);
+      //OpenCV : rows are padded to simd_align, the Mat takes the linesize
+      cv::Mat img = MatFrame::bgr(frame_rgb_);
+      cv::imshow("display", img);
     }
 
-  private:
-    void close()
+    void alloc_buffer(int width, int height)
     {
-      av_free(buffer_);
+      if (frame_rgb_->buf[0] && frame_rgb_->width == width && frame_rgb_->height == height) {
+        return;
+      }
+
+      chk(
+        frame_rgb_.get_buffer(pool_, AV_PIX_FMT_BGR24, width, height, ff::Frame::simd_align),
+        "viewer get_buffer"
+      );
     }
 
   };
-}
\ No newline at end of file
+}
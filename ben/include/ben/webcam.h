@@ -1,23 +1,238 @@
 ﻿#pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+#include "async_io.h"
+#include "decoder.h"
+#include "drop_queue.h"
+#include "encoder.h"
 #include "ffmpeg.h"
+#include "input.h"
+#include "motion.h"
+#include "scaler.h"
+#include "sink.h"
+#include "spsc_queue.h"
+#include "stats.h"
+#include "subscriber.h"
+
+// BEN_HEADLESS : no viewer and no opencv (recorders, servers).
+// set_view() does nothing and the view branches are compiled out.
+#if !defined(BEN_HEADLESS)
 #include "viewer.h"
+#endif
 
 namespace ben {
-  
+
+  // how a captured stream goes to the output
+  enum class StreamMode
+  {
+    Auto,   // copy when the output codec is the capture codec, otherwise encode
+    Copy,   // remux packets without decoding and reencoding
+    Encode  // decode, filter and encode
+  };
+
+  // what the read stage does when the capture buffer is full
+  enum class DropPolicy
+  {
+    Block,       // wait for the decoder, the input buffers (and drops) on its own
+    DropOldest,  // discard the oldest buffered packet (the reader takes it out, never waits)
+    DropNewest,  // discard the packet just read
+    Keyframe     // discard the oldest, then skip that stream until its next keyframe
+  };
+
+  // extra encoding of an input video stream, muxed as another output stream
+  // (after the input streams, in add_rendition order)
+  struct Rendition
+  {
+    int width = 0;                           // 0 : from height, keeping the aspect
+    int height = 0;                          // 0 : from width (both 0 : input size)
+    AVCodecID codec_id = AV_CODEC_ID_NONE;   // NONE : same codec as the main stream
+    int64_t bit_rate = 0;                    // 0 : encoder default
+  };
+
+  struct RenditionStatus
+  {
+    unsigned int output_stream = 0;
+    uint64_t written = 0; // packets muxed
+    uint64_t dropped = 0; // frames the encoder thread had no room for
+    std::size_t scale_slices = 0; // SliceScaler slices, 1 : one core, 0 : not scaled
+  };
+
+  // pixel format conversion left between the decoder and an encoder,
+  // done by the filter graph on every frame
+  struct FormatConversion
+  {
+    unsigned int output_stream = 0;
+    AVPixelFormat from = AV_PIX_FMT_NONE;
+    AVPixelFormat to = AV_PIX_FMT_NONE;
+    AVColorRange from_range = AVCOL_RANGE_UNSPECIFIED;
+    AVColorRange to_range = AVCOL_RANGE_UNSPECIFIED;
+  };
+
   class Webcam : public ff::Util
   {
+    friend class CaptureManager;
+
   private:
+    // decoded frame, or packet to remux, handed from decode stage to encode stage
+    struct StageItem
+    {
+      ff::Frame frame;
+      ff::Packet packet;
+      bool has_frame = false;
+      unsigned int stream_index = 0;
+    };
+
+    // one per add_rendition. the filter graph of its input stream splits into
+    // buffersink_ctx, the encoder thread scales (SliceScaler) and encodes.
+    struct RenditionContext
+    {
+      Rendition config;
+      unsigned int input_index = 0;
+      unsigned int output_index = 0;
+      AVFilterContext* buffersink_ctx = nullptr;
+      AVCodecContext* enc_ = nullptr;
+      ff::Frame filt_frame;
+      SliceScaler scaler;                        // encoder thread
+      ff::BufferPool scaled_pool;
+      ff::Frame scaled;
+      SpscQueue<StageItem>* frames = nullptr;    // has_frame == false : flush
+      SpscQueue<ff::Packet>* packets = nullptr;  // encoded, muxed by the muxing thread
+      std::thread thread;
+      std::atomic<bool> stop{ false };
+      std::atomic<bool> done{ false };
+      std::atomic<uint64_t> written{ 0 };
+      std::atomic<uint64_t> dropped{ 0 };
+      std::atomic<bool> force_key{ false };      // segment rollover : next frame as a keyframe
+    };
+
     std::string last_err_;
 
-    AVInputFormat* input_format_ = nullptr;
-    AVFormatContext* ifmt_ctx_ = nullptr;
+    std::unique_ptr<Input> input_;
+    AVFormatContext* ifmt_ctx_ = nullptr; // owned by input_
     ff::StreamContext* stream_ctx_ = nullptr;
     AVFormatContext* ofmt_ctx_ = nullptr;
     ff::FilteringContext* filter_ctx_ = nullptr;
 
+#if !defined(BEN_HEADLESS)
     Viewer viewer_;
+    bool view_ = true;
+#else
+    static const bool view_ = false;
+#endif
+
+    // reused every frame (decode and encode side respectively)
+    ff::Frame dec_frame_;
+    ff::Frame filt_frame_;
+    ff::BufferPool packet_pool_;
+    ff::Packet rendition_packet_; // muxing thread
+    ff::Packet dropped_packet_;   // read stage
+
+    std::map<unsigned int, StreamMode> stream_mode_;
+    std::map<unsigned int, DecoderConfig> decoder_config_;
+    std::vector<std::unique_ptr<ParallelDecoder>> parallel_; // per stream, null : the avcodec decoder
+    std::multimap<unsigned int, Rendition> rendition_config_;
+    std::vector<std::unique_ptr<RenditionContext>> renditions_;
+
+    // main output and rendition encoders mux from different threads
+    std::mutex mux_mutex_;
+
+    std::string output_format_;
+    EncoderConfig encoder_config_; // video streams
+    std::string output_filename_;
+
+    // output time base of each stream, fixed after the first header.
+    // encoders and remux rescale to it, so a segment rollover on the mux
+    // thread never races with them.
+    std::vector<AVRational> out_time_base_;
+
+    // fragmented mp4 / segmented output
+    bool fragmented_ = false;
+    int fragment_ms_ = 1000;
+    int64_t segment_ms_ = 0;
+    int64_t segment_size_ = 0;
+    int segment_index_ = 0;
+    int segment_key_stream_ = -1; // segments start on a keyframe of this stream
+    int64_t segment_start_pts_ = AV_NOPTS_VALUE;
+    std::chrono::steady_clock::time_point segment_start_;
+    std::vector<int64_t> segment_offset_; // segment start in each stream's out_time_base_
+
+    // finishes the last segment, then opens the next one ahead of time :
+    // a rollover on the mux thread only swaps contexts
+    std::thread segment_closer_;
+    AVOutputFormat* segment_format_ = nullptr;
+    std::vector<AVCodecParameters*> segment_params_; // stream layout of new segments
+    AVFormatContext* next_segment_ = nullptr;        // written by segment_closer_, taken after join
+    std::string next_segment_name_;
+    std::string next_segment_err_;
+
+    bool async_output_ = false;
+    AsyncWriterOptions async_options_;
+
+    // filter chain per input stream, empty : passthrough.
+    // written by set_filter, applied by the thread that filters.
+    std::mutex filter_mutex_;
+    std::map<unsigned int, std::string> filter_spec_;
+    std::atomic<bool> filter_changed_{ false };
+    std::vector<std::string> filter_active_; // spec the graph was built with
+    std::vector<bool> filtered_;             // decoded for the encoders, fixed at start_capture
+    std::vector<bool> bypass_;               // no graph : decoded frames go straight to the encoder
+    std::vector<bool> relabel_;              // yuvj frames renamed yuv + full range for the encoder
+    std::vector<AVRational> filter_time_base_; // 1/output rate of the video graph (fps=), renditions too
+    std::vector<FormatConversion> conversions_;
+
+    // encode only around motion (decoding thread)
+    std::unique_ptr<MotionGate> motion_;
+    int motion_stream_ = -1;
+
+    // tee : every muxed packet also goes to these, each on its own thread
+    std::vector<std::unique_ptr<SinkRunner>> sinks_;
+
+    // decoded frames of the first video stream to in-process consumers
+    FrameHub frames_;
+    int frame_stream_ = -1;
+
+    std::function<void(const AVPacket*)> write_callback_;
+    std::atomic<bool> eof_{ false };
+
+    // per stage latency, each histogram written by the thread running that stage
+    StatsCollector stats_;
+
+    // pipeline mode : read -> decode -> filter+encode -> mux, one thread per stage
+    bool pipeline_ = false;
+    std::size_t queue_size_ = 64;
+    DropQueue<ff::Packet>* read_queue_ = nullptr; // the reader may take the oldest out
+    SpscQueue<StageItem>* decode_queue_ = nullptr;
+    SpscQueue<ff::Packet>* mux_queue_ = nullptr;
+    std::size_t capture_buffer_ = 0; // read queue capacity, 0 : queue_size_
+    DropPolicy drop_policy_ = DropPolicy::Block;
+    std::atomic<uint64_t> skip_streams_{ 0 };  // Keyframe : bit per stream the reader dropped from
+    std::vector<bool> wait_keyframe_;           // decode stage only
+    std::thread read_thread_;
+    std::thread decode_thread_;
+    std::thread encode_thread_;
+    std::thread mux_thread_;
+    std::atomic<bool> reading_{ false };
+    std::atomic<bool> read_done_{ false };
+    std::atomic<bool> decode_done_{ false };
+    std::atomic<bool> encode_done_{ false };
+    std::atomic<bool> failed_{ false };
+    std::mutex err_mutex_;
+    std::string pipeline_err_;
+
+    // managed by CaptureManager : only the read stage has a thread, process()
+    // does the rest on the manager's pool. on_packet_ runs on the read thread.
+    bool managed_ = false;
+    std::function<void()> on_packet_;
+    ff::Packet process_packet_;
 
   public:
     Webcam() {}
@@ -32,20 +247,272 @@ namespace ben {
       return last_err_;
     }
 
+    // opt-in staged capture. must be called before start_capture.
+    // queue_size : capacity of each queue between stages
+    void set_pipeline(bool pipeline, std::size_t queue_size = 64)
+    {
+      pipeline_ = pipeline;
+      queue_size_ = queue_size;
+    }
+
+    bool pipeline() const
+    {
+      return pipeline_;
+    }
+
+    // bounded buffer between capture and decoding (pipeline mode, the read queue).
+    // packets : capacity, rounded up to a power of two. memory stays at that many
+    // packets however far behind the encoder is. drops show in stats().frames_dropped.
+    // serial capture reads inline and has no buffer besides the input's own.
+    void set_capture_buffer(std::size_t packets, DropPolicy policy)
+    {
+      capture_buffer_ = packets;
+      drop_policy_ = policy;
+    }
+
+    // force copy or encode per input stream. must be called before start_capture.
+    void set_stream_mode(unsigned int stream_index, StreamMode mode)
+    {
+      stream_mode_[stream_index] = mode;
+    }
+
+    // encode the video stream once more (other size, codec, bitrate). decode and
+    // filter input are shared, each rendition scales and encodes on its own thread.
+    // a rendition that falls behind drops frames, the main stream never waits for it.
+    // scaling runs on a few cores when the heights fit SliceScaler (1080 -> 720,
+    // 1080 -> 480, 2160 -> 720 ...), on one otherwise : rendition_status().scale_slices.
+    // must be called before start_capture.
+    void add_rendition(unsigned int stream_index, const Rendition& rendition)
+    {
+      rendition_config_.insert(std::make_pair(stream_index, rendition));
+    }
+
+    std::vector<RenditionStatus> rendition_status() const
+    {
+      std::vector<RenditionStatus> status;
+      for (auto& rendition : renditions_) {
+        RenditionStatus s;
+        s.output_stream = rendition->output_index;
+        s.written = rendition->written;
+        s.dropped = rendition->dropped;
+        s.scale_slices = rendition->scaler.slices();
+        status.push_back(s);
+      }
+      return status;
+    }
+
+    // libavfilter chain for an input stream ("scale=1280:-2,hqdn3d", "crop=640:480", "fps=15").
+    // empty : passthrough, and frames skip the graph when the encoder takes them as
+    // decoded. a filtered stream is encoded (StreamMode::Auto does not copy it).
+    // before start_capture the encoder gets the filter output size and rate.
+    // while capturing the graph is rebuilt at the next frame of that stream,
+    // scaled back to the encoder size when needed. frames an old graph still
+    // holds back (fps, temporal filters) are lost at the switch.
+    void set_filter(unsigned int stream_index, const std::string& spec)
+    {
+      std::lock_guard<std::mutex> lock(filter_mutex_);
+      filter_spec_[stream_index] = spec;
+      filter_changed_ = true;
+    }
+
+    // conversions the encoders could not avoid, known after start_capture.
+    // empty : every encoder takes the decoded pixel format (full range kept).
+    std::vector<FormatConversion> conversions() const
+    {
+      return conversions_;
+    }
+
+    // encode and write only while the video shows motion, plus pre/post roll.
+    // decoding goes on, idle frames are skipped before the filter, so encoder
+    // and disk load follow scene activity. copied streams are not gated.
+    // must be called before start_capture.
+    void set_motion(bool motion, const MotionOptions& options = MotionOptions())
+    {
+      motion_.reset(motion ? new MotionGate(options) : nullptr);
+    }
+
+    // decoder threads of an input stream, the rest pick them from the frame size.
+    // frame threads add up to thread_count - 1 frames of delay, slice threads none.
+    // intra only decoders without frame threads (mjpeg) decode on thread_count
+    // contexts in parallel instead. must be called before start_capture.
+    void set_decoder(unsigned int stream_index, const DecoderConfig& config)
+    {
+      decoder_config_[stream_index] = config;
+    }
+
+    // show the video stream in a window. a copied stream is decoded only for this.
+    // no window in a BEN_HEADLESS build.
+    void set_view(bool view)
+    {
+#if !defined(BEN_HEADLESS)
+      view_ = view;
+#else
+      (void)view;
+#endif
+    }
+
+    // muxer by name ("null", "matroska" ...). empty : guessed from the output filename.
+    void set_output_format(const std::string& format_name)
+    {
+      output_format_ = format_name;
+    }
+
+    // fragmented mp4/mov : empty moov, then a self contained fragment on every
+    // keyframe (and at least every fragment_ms). the muxer keeps no growing
+    // index, and a crash only loses the fragment being written.
+    void set_fragmented(bool fragmented, int fragment_ms = 1000)
+    {
+      fragmented_ = fragmented;
+      fragment_ms_ = fragment_ms;
+    }
+
+    // roll the output into a new file every duration_ms or size_bytes (0 : no limit),
+    // on a video keyframe. output_filename is a pattern ("rec_%03d.mp4"), otherwise
+    // the index goes before the extension (rec_000.mp4). every segment starts at
+    // timestamp 0 (one start time for all streams, sync kept) and its main video
+    // plays on its own. a finished segment gets its trailer on another thread,
+    // which then opens the next file ahead of the rollover.
+    // renditions : their encoders are asked for a keyframe at the rollover, but
+    // it lands a few frames late (queued frames), so a rendition track starts
+    // its segment mid gop and decodes from that keyframe.
+    void set_segment(int64_t duration_ms, int64_t size_bytes = 0)
+    {
+      segment_ms_ = duration_ms;
+      segment_size_ = size_bytes;
+    }
+
+    // write output files through AsyncWriter : the muxer only copies into memory,
+    // a thread per file does the disk I/O, so disk stalls stay off the capture timing
+    // until the budget is used up.
+    void set_async_output(bool async, const AsyncWriterOptions& options = AsyncWriterOptions())
+    {
+      async_output_ = async;
+      async_options_ = options;
+    }
+
+    // extra output fed with the same packets as the main one (encoded once).
+    // queue_size : packets the sink may fall behind before it drops.
+    // must be called before start_capture.
+    void add_sink(std::unique_ptr<Sink> sink, std::size_t queue_size = 256)
+    {
+      sinks_.emplace_back(new SinkRunner(std::move(sink), queue_size));
+    }
+
+    // a failed sink does not fail the capture : it shows here
+    std::vector<SinkStatus> sink_status() const
+    {
+      std::vector<SinkStatus> status;
+      for (auto& sink : sinks_) {
+        status.push_back(sink->status());
+      }
+      return status;
+    }
+
+    // consumer of the decoded frames of the first video stream, on its own thread.
+    // frames are references, not copies. subscribers asking for the same format
+    // share one conversion. queue_size : frames it may fall behind before it drops.
+    // must be called before start_capture.
+    void subscribe(
+      std::unique_ptr<FrameSubscriber> subscriber,
+      const FrameFormat& format = FrameFormat(),
+      std::size_t queue_size = 4
+    ) {
+      frames_.add(std::move(subscriber), format, queue_size);
+    }
+
+    // a failed subscriber does not fail the capture : it shows here
+    std::vector<SubscriberStatus> subscriber_status() const
+    {
+      return frames_.status();
+    }
+
+    // called with every packet right before it is muxed (on the muxing thread)
+    void set_write_callback(std::function<void(const AVPacket*)> callback)
+    {
+      write_callback_ = callback;
+    }
+
+    // time base of the packets the write callback gets for an output stream.
+    // fixed once capturing, renditions come after the input streams.
+    AVRational output_time_base(unsigned int stream_index) const
+    {
+      return stream_index < out_time_base_.size() ? out_time_base_[stream_index] : AVRational{ 0, 1 };
+    }
+
+    // per stage timing on/off (on by default, two clock reads per stage and frame)
+    void set_stats(bool enabled)
+    {
+      stats_.set_enabled(enabled);
+    }
+
+    // p50/p99/max per stage and frame counters since start_capture.
+    // safe to call from any thread while capturing.
+    CaptureStats stats() const
+    {
+      return stats_.snapshot();
+    }
+
+    void reset_stats()
+    {
+      stats_.reset();
+    }
+
+    // input reached its end (file, lavfi with duration). end_capture still has to be called.
+    bool eof() const
+    {
+      return eof_;
+    }
+
+    // dshow device (windows)
     bool start_capture(
       const std::string& video_name,
       const std::string& audio_name,
-      const std::string& output_filename
+      const std::string& output_filename,
+      const EncoderConfig& encoder = EncoderConfig()
+    ) {
+      return start_capture(
+        std::unique_ptr<Input>(new DshowInput(video_name, audio_name)),
+        output_filename,
+        encoder
+      );
+    }
+
+    // any capture source : DshowInput, FormatInput (file, lavfi), V4l2Input.
+    // encoder : video encoder and its tuning, default keeps the capture codec.
+    bool start_capture(
+      std::unique_ptr<Input> input,
+      const std::string& output_filename,
+      const EncoderConfig& encoder = EncoderConfig()
     ) {
-      av_register_all();
       av_register_all();
       avfilter_register_all();
       avdevice_register_all();
 
+      input_ = std::move(input);
+      encoder_config_ = encoder;
+      eof_ = false;
+      stats_.reset();
+      motion_stream_ = -1;
+      frame_stream_ = -1;
+      if (motion_) {
+        motion_->reset();
+      }
+
       try {
-        prepare_input(video_name, audio_name);
+        prepare_input();
         prepare_output(output_filename);
         prepare_filter();
+        for (auto& sink : sinks_) {
+          sink->start(ofmt_ctx_);
+        }
+        if (frame_stream_ >= 0) {
+          frames_.start(stream_ctx_[frame_stream_].dec_->time_base);
+        }
+        if (pipeline_) {
+          start_pipeline();
+        } else if (managed_) {
+          start_reader();
+        }
       } catch (std::runtime_error& e) {
         last_err_ = e.what();
         close();
@@ -56,11 +523,37 @@ namespace ben {
 
     bool capturing()
     {
+      if (pipeline_ || managed_) {
+        // stages run on their own threads. only report their state.
+        if (failed_) {
+          std::lock_guard<std::mutex> lock(err_mutex_);
+          last_err_ = pipeline_err_;
+          return false;
+        }
+        if (eof_) {
+          last_err_ = "end of input";
+          return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return true;
+      }
+
+      int ret = 0;
       try {
-        capture_internal();
+        ret = capture_internal();
       }
       catch (std::runtime_error& e) {
-        last_err_ = e.what();
+        // user callbacks
+        fail(e);
+      }
+      if (ret == AVERROR_EOF) {
+        last_err_ = "end of input";
+        return false;
+      }
+      if (ret < 0 || failed_) {
+        // this thread or a rendition encoder thread
+        std::lock_guard<std::mutex> lock(err_mutex_);
+        last_err_ = pipeline_err_;
         return false;
       }
       return true;
@@ -69,8 +562,40 @@ namespace ben {
     bool end_capture()
     {
       try {
-        flush_filter_and_encoder();
+        if (pipeline_) {
+          // stop reading, then each stage drains its queue in order
+          // and the encode stage flushes filter and encoder.
+          stop_pipeline();
+          if (failed_) {
+            std::lock_guard<std::mutex> lock(err_mutex_);
+            throw std::runtime_error(pipeline_err_);
+          }
+        } else if (managed_) {
+          // the manager runs no process() any more : drain here
+          stop_reader();
+          while (process(64) > 0) {
+          }
+          if (!failed_) {
+            flush_filter_and_encoder();
+          }
+        } else if (!failed_) {
+          flush_filter_and_encoder();
+        }
+        // renditions got their flush from the filter
+        stop_renditions();
+        if (failed_) {
+          std::lock_guard<std::mutex> lock(err_mutex_);
+          throw std::runtime_error(pipeline_err_);
+        }
+        // every packet is pushed : sinks finish on their own
+        stop_sinks();
+        frames_.stop();
         chk(av_write_trailer(ofmt_ctx_), "av_write_trailer");
+        if (ofmt_ctx_->opaque) {
+          chk(static_cast<AsyncWriter*>(ofmt_ctx_->opaque)->flush(), "async output flush");
+        }
+        join_segment_closer();
+        discard_next_segment();
       }
       catch (std::runtime_error& e) {
         last_err_ = e.what();
@@ -82,7 +607,24 @@ namespace ben {
   private:
     void close()
     {
-      for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++) {
+      stop_pipeline();
+      stop_renditions();
+      stop_sinks();
+      frames_.stop();
+      if (motion_) {
+        // held pre roll frames
+        motion_->reset();
+      }
+      for (auto& rendition : renditions_) {
+        avcodec_free_context(&rendition->enc_);
+        delete rendition->frames;
+        delete rendition->packets;
+      }
+      // buffersinks belong to the filter graphs freed below
+      renditions_.clear();
+      parallel_.clear();
+
+      for (unsigned int i = 0; ifmt_ctx_ && stream_ctx_ && i < ifmt_ctx_->nb_streams; i++) {
         avcodec_free_context(&stream_ctx_[i].dec_);
         if (ofmt_ctx_ && ofmt_ctx_->nb_streams > i && ofmt_ctx_->streams[i] && stream_ctx_[i].enc_) {
           avcodec_free_context(&stream_ctx_[i].enc_);
@@ -91,117 +633,772 @@ namespace ben {
           avfilter_graph_free(&filter_ctx_[i].filter_graph);
         }
       }
-      av_free(filter_ctx_);
-      av_free(stream_ctx_);
-      avformat_close_input(&ifmt_ctx_);
-      if (ofmt_ctx_ && !(ofmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
-        avio_closep(&ofmt_ctx_->pb);
+      av_freep(&filter_ctx_);
+      av_freep(&stream_ctx_);
+      if (input_) {
+        input_->close();
+      }
+      ifmt_ctx_ = nullptr;
+      join_segment_closer();
+      discard_next_segment();
+      for (auto& par : segment_params_) {
+        avcodec_parameters_free(&par);
       }
-      avformat_free_context(ofmt_ctx_);
+      segment_params_.clear();
+      free_output(ofmt_ctx_);
+      ofmt_ctx_ = nullptr;
     }
 
-    void flush_filter_and_encoder()
+    // sinks write what they have queued and close
+    void stop_sinks()
     {
+      for (auto& sink : sinks_) {
+        sink->stop();
+      }
+    }
+
+    static void free_output(AVFormatContext* ctx)
+    {
+      if (ctx && ctx->opaque) {
+        // AsyncWriter : flush what is left and close the file
+        AsyncWriter* writer = static_cast<AsyncWriter*>(ctx->opaque);
+        int ret = writer->close();
+        if (ret < 0) {
+          av_log(nullptr, AV_LOG_ERROR, "async output close : %d\n", ret);
+        }
+        delete writer;
+        ctx->opaque = nullptr;
+        ctx->pb = nullptr;
+      } else if (ctx && !(ctx->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&ctx->pb);
+      }
+      avformat_free_context(ctx);
+    }
+
+    // failures are reported through fail(), like the rest of the frame path
+    int flush_filter_and_encoder()
+    {
+      if (!pipeline_) {
+        // pipeline : the decode stage drained the decoders
+        int ret = flush_decoders();
+        if (ret < 0) {
+          return ret;
+        }
+      }
+
       // flush filter and encoder
       for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++) {
         //flush filter
-        if (!filter_ctx_[i].filter_graph) {
+        if (!filtered(i)) {
+          continue;
+        }
+        int ret = filter_encode_write_frame(nullptr, i);
+        if (ret < 0) {
+          return ret;
+        }
+
+        //flush encoder (none when only renditions are encoded)
+        if (stream_ctx_[i].enc_ && stream_ctx_[i].enc_->codec->capabilities & AV_CODEC_CAP_DELAY) {
+          ret = encode_write_frame(nullptr, i);
+          if (ret < 0) {
+            return ret;
+          }
+        }
+      }
+      return 0;
+    }
+
+    // frames the decoders still hold : up to thread_count - 1 with frame
+    // threads, reordered frames (b-frames) otherwise
+    int flush_decoders()
+    {
+      for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++) {
+        AVCodecContext* dec_ctx = stream_ctx_[i].dec_;
+        bool decoded = stream_ctx_[i].copy_ ? need_decode(i) : filtered(i);
+        if (!dec_ctx || !decoded) {
           continue;
         }
-        filter_encode_write_frame(ff::Frame(false), i);
 
-        //flush encoder
-        if (stream_ctx_[i].enc_->codec->capabilities & AV_CODEC_CAP_DELAY) {
-          encode_write_frame(ff::Frame(false), i);
+        StageTimer timer(stats_.stage(Stage::Decode));
+        send_packet(i, nullptr);
+        int ret = receive_frames(dec_ctx, dec_frame_, i, timer);
+        if (ret < 0) {
+          return ret;
         }
       }
+      return 0;
     }
 
-    void capture_internal()
+    // per frame path : no exceptions, every function returns an AVERROR code.
+    // a failure is recorded by error() (fail()) where it happens, callers only
+    // pass the code up. chk() is for setup.
+    int capture_internal()
     {
       ff::Packet packet;
 
-      chk(
-        av_read_frame(ifmt_ctx_, packet),
-        "capture av_read_frame"
-      );
+      int ret = read_packet(packet);
+      if (ret == AVERROR_EOF) {
+        eof_ = true;
+        return ret;
+      }
+      if (ret < 0) {
+        return error(ret, "capture read");
+      }
+
+      return decode_packet(packet);
+    }
+
+    int read_packet(ff::Packet& packet)
+    {
+      StageTimer timer(stats_.stage(Stage::Read));
+      int ret = input_->read(packet);
+      if (ret >= 0) {
+        stats_.frame_in();
+      }
+      return ret;
+    }
 
+    int decode_packet(ff::Packet& packet)
+    {
       int stream_index = packet->stream_index;
 
-      AVMediaType type = ifmt_ctx_->streams[stream_index]->codecpar->codec_type;
+      if (stream_ctx_[stream_index].copy_) {
+        if (need_decode(stream_index)) {
+          int ret = decode_frame(packet, stream_index);
+          if (ret < 0) {
+            return ret;
+          }
+        }
+        return remux_packet(packet, stream_index);
+      }
+      else if (filtered(stream_index)) {
+        return decode_frame(packet, stream_index);
+      }
+      else {
+        return remux_packet(packet, stream_index);
+      }
+    }
 
-      if (filter_ctx_[stream_index].filter_graph) {
-        AVCodecContext* dec_ctx = stream_ctx_[stream_index].dec_;
+    // frames of a copied stream are only needed by the viewer, renditions and subscribers
+    bool need_decode(int stream_index)
+    {
+      return
+        (view_ && stream_ctx_[stream_index].dec_->codec_type == AVMEDIA_TYPE_VIDEO) ||
+        has_renditions(stream_index) ||
+        stream_index == frame_stream_;
+    }
 
-        av_packet_rescale_ts(
-          packet,
-          ifmt_ctx_->streams[stream_index]->time_base,
-          dec_ctx->time_base
-        );
+    bool has_renditions(unsigned int stream_index) const
+    {
+      return rendition_config_.count(stream_index) > 0;
+    }
 
-        // decode
-        int ret = avcodec_send_packet(dec_ctx, packet);
+    // sends one packet, then takes every frame the decoder has ready.
+    // a frame threaded decoder gives nothing for its first packets, then a frame
+    // per packet : EAGAIN is the normal "need more input" answer here.
+    int decode_frame(ff::Packet& packet, int stream_index)
+    {
+      AVCodecContext* dec_ctx = stream_ctx_[stream_index].dec_;
+
+      // shallow copy for the decoder time base. packet itself may still be remuxed.
+      AVPacket dec_packet = *packet.get();
+      av_packet_rescale_ts(
+        &dec_packet,
+        ifmt_ctx_->streams[stream_index]->time_base,
+        dec_ctx->time_base
+      );
+
+      // dec_frame_ is kept, only its data reference changes per frame
+      ff::Frame& frame = dec_frame_;
+
+      StageTimer timer(stats_.stage(Stage::Decode));
+      int ret = send_packet(stream_index, &dec_packet);
+      if (ret == AVERROR(EAGAIN)) {
+        // output not taken yet : take it, then the packet fits
+        ret = receive_frames(dec_ctx, frame, stream_index, timer);
         if (ret < 0) {
-          if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            return;
-          }
-          chk(ret, "avcodec_send_packet");
+          return ret;
         }
+        ret = send_packet(stream_index, &dec_packet);
+      }
+      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        // packet not taken by the decoder
+        stats_.frame_dropped();
+        return 0;
+      }
+      if (ret < 0) {
+        // broken packet (a bad mjpeg frame ...) : the next one decodes again
+        av_log(nullptr, AV_LOG_WARNING, "stream %d : packet not decoded (%d)\n", stream_index, ret);
+        stats_.frame_dropped();
+        return 0;
+      }
 
-        ff::Frame frame;
-        chk(avcodec_receive_frame(dec_ctx, frame), "avcodec_receive_frame");
+      return receive_frames(dec_ctx, frame, stream_index, timer);
+    }
 
-        if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-          viewer_.view(dec_ctx, frame);
+    int send_packet(int stream_index, const AVPacket* packet)
+    {
+      if (parallel_[stream_index]) {
+        return parallel_[stream_index]->send_packet(packet);
+      }
+      return avcodec_send_packet(stream_ctx_[stream_index].dec_, packet);
+    }
+
+    // every decoded frame ready, until EAGAIN / EOF. timer : decode time only.
+    int receive_frames(AVCodecContext* dec_ctx, ff::Frame& frame, int stream_index, StageTimer& timer)
+    {
+      while (true) {
+        int ret = parallel_[stream_index] ?
+          parallel_[stream_index]->receive_frame(frame) :
+          avcodec_receive_frame(dec_ctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+          return 0;
+        }
+        if (ret < 0) {
+          av_log(nullptr, AV_LOG_WARNING, "stream %d : frame not decoded (%d)\n", stream_index, ret);
+          stats_.frame_dropped();
+          if (parallel_[stream_index]) {
+            // that packet only, the frames behind it are fine
+            continue;
+          }
+          return 0;
         }
 
-        frame->pts = av_frame_get_best_effort_timestamp(frame);
-        filter_encode_write_frame(frame, stream_index);
+        timer.pause();
+        ret = decoded_frame(dec_ctx, frame, stream_index);
+        timer.resume();
+        if (ret < 0) {
+          return ret;
+        }
       }
-      else {
-        // remux this frame without reencoding
-        av_packet_rescale_ts(
-          packet,
-          ifmt_ctx_->streams[stream_index]->time_base,
-          ofmt_ctx_->streams[stream_index]->time_base
-        );
+    }
 
-        chk(
-          av_interleaved_write_frame(ofmt_ctx_, packet),
-          "capture av_interleaved_write_frame"
-        );
+    int decoded_frame(AVCodecContext* dec_ctx, ff::Frame& frame, int stream_index)
+    {
+      if (relabel_[stream_index]) {
+        // yuvj : same planes, the range goes as metadata (no scaler)
+        frame->format = ff::PixFmt::limited(static_cast<AVPixelFormat>(frame->format));
+        frame->color_range = AVCOL_RANGE_JPEG;
       }
+
+      frame->pts = av_frame_get_best_effort_timestamp(frame);
+
+#if !defined(BEN_HEADLESS)
+      if (view_ && dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        StageTimer timer(stats_.stage(Stage::View));
+        viewer_.view(dec_ctx, frame);
+      }
+#endif
+
+      if (stream_index == frame_stream_) {
+        // references only, conversions run on the converter threads
+        frames_.publish(frame);
+      }
+
+      if (stream_ctx_[stream_index].copy_ && !has_renditions(stream_index)) {
+        frame.unref();
+        return 0;
+      }
+
+      if (motion_) {
+        int ret = gate_frame(frame, stream_index);
+        if (ret <= 0) {
+          return ret;
+        }
+      }
+      return forward_frame(frame, stream_index);
     }
 
-    void prepare_input(const std::string& video_name = "", const std::string audio_name = "")
+    // 1 : encode the frame. 0 : held for pre roll (or let go) instead
+    int gate_frame(ff::Frame& frame, int stream_index)
     {
-      AVDictionary* av_option = nullptr;
-      av_dict_set(&av_option, "rtbufsize", "1000000000", NULL);
-      input_format_ = av_find_input_format("dshow");
-      ifmt_ctx_ = avformat_alloc_context();
+      if (motion_stream_ < 0 && stream_ctx_[stream_index].dec_->codec_type == AVMEDIA_TYPE_VIDEO) {
+        motion_stream_ = stream_index;
+      }
 
-      std::string device_name = "video=";
-      device_name.append(video_name);
-      if (!audio_name.empty()) {
-        device_name.append(":audio=");
-        device_name.append(audio_name);
+      bool was_active = motion_->active();
+      if (stream_index == motion_stream_) {
+        StageTimer timer(stats_.stage(Stage::Motion));
+        motion_->update(frame);
       }
 
-      // 파일일 경우 device_name 에 경로, input_format은 NULL;
-      chk(
-        avformat_open_input(&ifmt_ctx_, device_name.c_str(), input_format_, &av_option),
-        "input avformat_open_input"
-      );
+      if (motion_->active()) {
+        if (!was_active) {
+          int ret = motion_->release([&](ff::Frame& held, int held_index) {
+            return forward_frame(held, held_index);
+          });
+          if (ret < 0) {
+            return ret;
+          }
+        }
+        return 1;
+      }
 
-      av_dict_free(&av_option);
+      stats_.frame_skipped(motion_->hold(frame, stream_index));
+      return 0;
+    }
 
-      chk(
-        avformat_find_stream_info(ifmt_ctx_, NULL),
-        "input avformat_find_stream_info"
+    // decoded frame on to filter and encoders
+    int forward_frame(ff::Frame& frame, int stream_index)
+    {
+      if (pipeline_) {
+        return push_stage(*decode_queue_, [&](StageItem& slot) {
+          slot.frame = std::move(frame);
+          slot.packet.unref();
+          slot.has_frame = true;
+          slot.stream_index = stream_index;
+        });
+      }
+
+      int ret = filter_encode_write_frame(frame, stream_index);
+      frame.unref();
+      return ret;
+    }
+
+    int remux_packet(ff::Packet& packet, int stream_index)
+    {
+      // remux this frame without reencoding
+      av_packet_rescale_ts(
+        packet,
+        ifmt_ctx_->streams[stream_index]->time_base,
+        out_time_base_[stream_index]
       );
 
+      if (pipeline_) {
+        // keep the order with encoded packets : goes through the encode stage
+        return push_stage(*decode_queue_, [&](StageItem& slot) {
+          slot.packet = std::move(packet);
+          slot.frame.unref();
+          slot.has_frame = false;
+          slot.stream_index = stream_index;
+        });
+      }
+      return write_packet(packet);
+    }
+
+    int write_packet(ff::Packet& packet)
+    {
+      if (pipeline_) {
+        // takes the reference like av_interleaved_write_frame does
+        return push_stage(*mux_queue_, [&](ff::Packet& slot) {
+          slot = std::move(packet);
+        });
+      }
+
+      return mux_packet(packet);
+    }
+
+    int mux_packet(ff::Packet& packet)
+    {
+      std::lock_guard<std::mutex> lock(mux_mutex_);
+
+      // rendition packets encoded since the last one
+      int ret = mux_renditions();
+      if (ret < 0) {
+        return ret;
+      }
+      return mux_locked(packet);
+    }
+
+    // the muxing thread (under mux_mutex_). rendition encoders only queue packets.
+    int mux_renditions()
+    {
+      ff::Packet& packet = rendition_packet_;
+      for (auto& rendition : renditions_) {
+        while (rendition->packets->pop(packet)) {
+          int ret = mux_locked(packet);
+          packet.unref();
+          if (ret < 0) {
+            return ret;
+          }
+          rendition->written++;
+        }
+      }
+      return 0;
+    }
+
+    int mux_locked(ff::Packet& packet)
+    {
+      if (write_callback_) {
+        write_callback_(packet);
+      }
+
+      // by reference, before the main muxer takes the packet
+      for (auto& sink : sinks_) {
+        sink->push(packet);
+      }
+
+      if (segmented() && segment_full(packet)) {
+        // opens a file : setup code, may throw
+        try {
+          roll_segment();
+        } catch (std::runtime_error& e) {
+          fail(e);
+          return AVERROR_EXTERNAL;
+        }
+      }
+
+      if (segmented()) {
+        rebase_segment(packet);
+      }
+
+      // a segment muxer may have picked another time base than the first one
+      AVRational time_base = ofmt_ctx_->streams[packet->stream_index]->time_base;
+      if (av_cmp_q(time_base, out_time_base_[packet->stream_index]) != 0) {
+        av_packet_rescale_ts(packet, out_time_base_[packet->stream_index], time_base);
+      }
+
+      // renditions have their own counters
+      bool main = static_cast<unsigned int>(packet->stream_index) < ifmt_ctx_->nb_streams;
+
+      StageTimer timer(stats_.stage(Stage::Write));
+      int ret = av_interleaved_write_frame(ofmt_ctx_, packet);
+      if (ret < 0) {
+        return error(ret, "av_interleaved_write_frame");
+      }
+      if (main) {
+        stats_.frame_out();
+      }
+      return 0;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // pipeline
+
+    void start_pipeline()
+    {
+      // every slot owns its frame shell from here on
+      read_queue_ = new DropQueue<ff::Packet>(capture_buffer_ ? capture_buffer_ : queue_size_);
+      decode_queue_ = new SpscQueue<StageItem>(queue_size_);
+      mux_queue_ = new SpscQueue<ff::Packet>(queue_size_);
+
+      failed_ = false;
+      read_done_ = false;
+      decode_done_ = false;
+      encode_done_ = false;
+      skip_streams_ = 0;
+      wait_keyframe_.assign(ifmt_ctx_->nb_streams, false);
+      reading_ = true;
+
+      mux_thread_ = std::thread(&Webcam::mux_stage, this);
+      encode_thread_ = std::thread(&Webcam::encode_stage, this);
+      decode_thread_ = std::thread(&Webcam::decode_stage, this);
+      read_thread_ = std::thread(&Webcam::read_stage, this);
+    }
+
+    // managed : read stage only, the queue is drained by process()
+    void start_reader()
+    {
+      read_queue_ = new DropQueue<ff::Packet>(capture_buffer_ ? capture_buffer_ : queue_size_);
+
+      failed_ = false;
+      read_done_ = false;
+      skip_streams_ = 0;
+      wait_keyframe_.assign(ifmt_ctx_->nb_streams, false);
+      reading_ = true;
+
+      read_thread_ = std::thread(&Webcam::read_stage, this);
+    }
+
+    void stop_reader()
+    {
+      reading_ = false;
+      if (read_thread_.joinable()) {
+        read_thread_.join();
+      }
+    }
+
+    // managed : decodes, filters, encodes and muxes up to max_packets queued
+    // packets on the calling thread. never called concurrently for one Webcam.
+    std::size_t process(std::size_t max_packets)
+    {
+      std::size_t count = 0;
+      try {
+        ff::Packet& packet = process_packet_;
+        while (count < max_packets && !failed_ && read_queue_->pop(packet)) {
+          int ret = drop_captured(packet) ? 0 : decode_packet(packet);
+          packet.unref();
+          count++;
+          if (ret < 0) {
+            break;
+          }
+        }
+      } catch (std::runtime_error& e) {
+        fail(e);
+      }
+      return count;
+    }
+
+    // managed : packets waiting for process()
+    bool pending() const
+    {
+      return read_queue_ && !failed_ && !read_queue_->empty();
+    }
+
+    void stop_pipeline()
+    {
+      reading_ = false;
+
+      // upstream first, so every stage sees its input closed after draining it
+      if (read_thread_.joinable()) read_thread_.join();
+      if (decode_thread_.joinable()) decode_thread_.join();
+      if (encode_thread_.joinable()) encode_thread_.join();
+      if (mux_thread_.joinable()) mux_thread_.join();
+
+      // left over references (only when a stage failed) go with the slots
+      delete read_queue_;
+      delete decode_queue_;
+      delete mux_queue_;
+      read_queue_ = nullptr;
+      decode_queue_ = nullptr;
+      mux_queue_ = nullptr;
+    }
+
+    void read_stage()
+    {
+      try {
+        ff::Packet packet;
+        bool overloaded = false;
+        while (reading_ && !failed_) {
+          int ret = read_packet(packet);
+          if (ret == AVERROR_EOF) {
+            // not an error : stages drain what they have
+            eof_ = true;
+            break;
+          }
+          if (ret < 0) {
+            error(ret, "capture read");
+            break;
+          }
+          ret = packet.make_refcounted(packet_pool_);
+          if (ret < 0) {
+            error(ret, "capture make_refcounted");
+            break;
+          }
+
+          auto fill = [&](ff::Packet& slot) {
+            slot = std::move(packet);
+          };
+          if (read_queue_->push_with(fill)) {
+            overloaded = false;
+            if (on_packet_) {
+              on_packet_();
+            }
+            continue;
+          }
+
+          if (!overloaded) {
+            overloaded = true;
+            av_log(nullptr, AV_LOG_WARNING, "capture buffer full (%u packets)\n",
+              static_cast<unsigned int>(read_queue_->capacity()));
+          }
+
+          switch (drop_policy_) {
+          case DropPolicy::DropNewest:
+            packet.unref();
+            stats_.frame_dropped();
+            break;
+          case DropPolicy::DropOldest:
+          case DropPolicy::Keyframe:
+            drop_oldest(packet);
+            break;
+          default:
+            ret = push_stage(*read_queue_, fill);
+            break;
+          }
+          if (ret < 0) {
+            break;
+          }
+
+          if (on_packet_) {
+            on_packet_();
+          }
+        }
+      } catch (std::runtime_error& e) {
+        fail(e);
+      }
+      read_done_ = true;
+      if (on_packet_) {
+        on_packet_();
+      }
+    }
+
+    void decode_stage()
+    {
+      try {
+        ff::Packet packet;
+        while (pop_stage(*read_queue_, packet, read_done_)) {
+          int ret = drop_captured(packet) ? 0 : decode_packet(packet);
+          packet.unref();
+          if (ret < 0) {
+            break;
+          }
+        }
+        if (!failed_) {
+          flush_decoders();
+        }
+      } catch (std::runtime_error& e) {
+        fail(e);
+      }
+      decode_done_ = true;
+    }
+
+    // read stage : takes the oldest packet out itself, then queues the new one.
+    // never waits : the slot may still be moved out by the decoder, then the
+    // new packet goes instead.
+    void drop_oldest(ff::Packet& packet)
+    {
+      ff::Packet& oldest = dropped_packet_;
+      if (read_queue_->pop(oldest)) {
+        stats_.frame_dropped();
+        int stream_index = oldest->stream_index;
+        if (drop_policy_ == DropPolicy::Keyframe && stream_index < 64) {
+          // the decoder skips that stream up to its next keyframe
+          skip_streams_.fetch_or(uint64_t(1) << stream_index);
+        }
+        oldest.unref();
+      }
+      bool pushed = read_queue_->push_with([&](ff::Packet& slot) {
+        slot = std::move(packet);
+      });
+      if (!pushed) {
+        packet.unref();
+        stats_.frame_dropped();
+      }
+    }
+
+    // decode stage side of the drop policies
+    bool drop_captured(ff::Packet& packet)
+    {
+      int stream_index = packet->stream_index;
+
+      if (skip_streams_.load(std::memory_order_relaxed)) {
+        uint64_t skip = skip_streams_.exchange(0);
+        for (unsigned int i = 0; i < wait_keyframe_.size() && i < 64; i++) {
+          if (skip & (uint64_t(1) << i)) {
+            wait_keyframe_[i] = true;
+          }
+        }
+      }
+
+      if (wait_keyframe_[stream_index]) {
+        if (!(packet->flags & AV_PKT_FLAG_KEY)) {
+          stats_.frame_dropped();
+          return true;
+        }
+        wait_keyframe_[stream_index] = false;
+      }
+      return false;
+    }
+
+    void encode_stage()
+    {
+      try {
+        StageItem item;
+        while (pop_stage(*decode_queue_, item, decode_done_)) {
+          int ret = 0;
+          if (item.has_frame) {
+            ret = filter_encode_write_frame(item.frame, item.stream_index);
+            item.frame.unref();
+          } else {
+            ret = write_packet(item.packet);
+          }
+          if (ret < 0) {
+            break;
+          }
+        }
+        if (!failed_) {
+          flush_filter_and_encoder();
+        }
+      } catch (std::runtime_error& e) {
+        fail(e);
+      }
+      encode_done_ = true;
+    }
+
+    void mux_stage()
+    {
+      try {
+        ff::Packet packet;
+        while (pop_stage(*mux_queue_, packet, encode_done_)) {
+          if (mux_packet(packet) < 0) {
+            break;
+          }
+        }
+      } catch (std::runtime_error& e) {
+        fail(e);
+      }
+    }
+
+    // blocks while the queue is full (backpressure to the upstream stage).
+    // fill(T& slot) moves the item into the queue slot.
+    // AVERROR_EXIT : another stage failed, the item is not queued.
+    template <typename Queue, typename Fill>
+    int push_stage(Queue& queue, Fill fill)
+    {
+      while (!queue.push_with(fill)) {
+        if (failed_) {
+          return AVERROR_EXIT;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+      }
+      return 0;
+    }
+
+    // false when upstream is done and the queue is drained
+    template <typename Queue, typename T>
+    bool pop_stage(Queue& queue, T& item, std::atomic<bool>& upstream_done)
+    {
+      while (!failed_) {
+        if (queue.pop(item)) {
+          return true;
+        }
+        if (upstream_done) {
+          // upstream may have pushed right before it finished
+          return queue.pop(item);
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+      }
+      return false;
+    }
+
+    void fail(std::runtime_error& e)
+    {
+      fail(e.what());
+    }
+
+    // first failure wins, every stage stops
+    void fail(const char* err)
+    {
+      std::lock_guard<std::mutex> lock(err_mutex_);
+      if (!failed_) {
+        pipeline_err_ = err;
+        failed_ = true;
+      }
+    }
+
+    // frame path counterpart of chk : records the failure, returns ret
+    int error(int ret, const char* what)
+    {
+      char av_err_str[AV_ERROR_MAX_STRING_SIZE] = { 0, };
+      av_make_error_string(av_err_str, AV_ERROR_MAX_STRING_SIZE, ret);
+
+      char buf[1024] = { 0, };
+      snprintf(buf, sizeof(buf), "av fail (%d:%s). %s", ret, av_err_str, what);
+      fail(buf);
+      return ret;
+    }
+
+    void prepare_input()
+    {
+      input_->open();
+      ifmt_ctx_ = input_->format_context();
+      chk(ifmt_ctx_, "input format context : %s", input_->name().c_str());
+
       stream_ctx_ = (ff::StreamContext*)av_mallocz_array(ifmt_ctx_->nb_streams, sizeof(*stream_ctx_));
       chk(stream_ctx_, "input av_mallocz_array streams");
+      parallel_.clear();
+      parallel_.resize(ifmt_ctx_->nb_streams);
 
 
       for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++) {
@@ -240,27 +1437,56 @@ namespace ben {
             dec_ctx->framerate = av_guess_frame_rate(ifmt_ctx_, stream, NULL);
           }
 
+          auto config = decoder_config_.find(i);
+          int parallel = DecoderSetup::apply(
+            config != decoder_config_.end() ? config->second : DecoderConfig(),
+            dec,
+            dec_ctx
+          );
+
           chk(
             avcodec_open2(dec_ctx, dec, NULL),
             "input avcodec_open2[stream: %u, codec_id: %d]",
             i, static_cast<int>(dec_id)
           );
 
-          if (dec_type == AVMEDIA_TYPE_VIDEO) {
+          if (parallel > 1) {
+            // dec_ctx stays open for its parameters, the contexts decode
+            parallel_[i].reset(new ParallelDecoder(dec, dec_par, dec_ctx, parallel));
+          }
+
+#if !defined(BEN_HEADLESS)
+          if (view_ && dec_type == AVMEDIA_TYPE_VIDEO) {
             viewer_.init(dec_ctx);
           }
+#endif
+          if (!frames_.empty() && frame_stream_ < 0 && dec_type == AVMEDIA_TYPE_VIDEO) {
+            frame_stream_ = i;
+          }
         }
         stream_ctx_[i].dec_ = dec_ctx;
       }
 
-      //av_dump_format(ifmt_ctx_, 0, device_name.c_str(), 0);
+      //av_dump_format(ifmt_ctx_, 0, input_->name().c_str(), 0);
     }
 
-    void prepare_output(const std::string& output_filename)
+    void prepare_output(const std::string& output_name)
     {
+      output_filename_ = output_name;
+      segment_index_ = 0;
+      segment_start_pts_ = AV_NOPTS_VALUE;
+      segment_start_ = std::chrono::steady_clock::now();
+      std::string output_filename = segmented() ? segment_filename(0) : output_name;
+      relabel_.assign(ifmt_ctx_->nb_streams, false);
+      filter_time_base_.assign(ifmt_ctx_->nb_streams, AVRational{ 0, 1 });
+      conversions_.clear();
 
       chk(
-        avformat_alloc_output_context2(&ofmt_ctx_, NULL, NULL, output_filename.c_str()),
+        avformat_alloc_output_context2(
+          &ofmt_ctx_, NULL,
+          output_format_.empty() ? NULL : output_format_.c_str(),
+          output_filename.c_str()
+        ),
         "output avformat_alloc_output_context2 : %s", output_filename.c_str()
       );
       chk(
@@ -280,13 +1506,34 @@ namespace ben {
         AVStream* in_stream = ifmt_ctx_->streams[i];
         AVCodecContext* dec_ctx = stream_ctx_[i].dec_;
 
-        if (
+        bool av_stream =
           dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ||
-          dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO
-        ) {
+          dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO;
+
+        AVCodecID enc_id = dec_ctx->codec_id;
+        AVCodec* enc = nullptr;
+        if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+          enc = EncoderSetup::find(encoder_config_);
+          if (enc) {
+            enc_id = enc->id;
+          }
+        }
+
+        if (av_stream && use_copy(i, enc_id)) {
+          // stream copy : same codec, no reason to decode and reencode
+          chk(
+            avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar),
+            "output avcodec_parameters_copy[stream: %u]", i
+          );
+          out_stream->codecpar->codec_tag = 0;
+          out_stream->time_base = in_stream->time_base;
+          stream_ctx_[i].copy_ = true;
 
-          //AVCodec* enc = avcodec_find_encoder(AV_CODEC_ID_H264);
-          AVCodec* enc = avcodec_find_encoder(dec_ctx->codec_id);
+        } else if (av_stream) {
+
+          if (!enc) {
+            enc = avcodec_find_encoder(enc_id);
+          }
           chk(
             enc,
             "output avcodec_find_encoder"
@@ -303,13 +1550,28 @@ namespace ben {
             enc_ctx->width = dec_ctx->width;
             enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
 
-            if (enc->pix_fmts) {
-              enc_ctx->pix_fmt = enc->pix_fmts[0];
-            } else {
-              enc_ctx->pix_fmt = dec_ctx->pix_fmt;
-            }
+            relabel_[i] = negotiate_pix_fmt(enc, dec_ctx->pix_fmt, dec_ctx->color_range, enc_ctx, i);
+            enc_ctx->colorspace = dec_ctx->colorspace;
+            enc_ctx->color_primaries = dec_ctx->color_primaries;
+            enc_ctx->color_trc = dec_ctx->color_trc;
             enc_ctx->time_base = av_inv_q(dec_ctx->framerate);
 
+            std::string spec = filter_spec(i);
+            if (!passthrough(spec)) {
+              // sized like the filter output (scale, crop, fps ...)
+              ff::FilteringContext probe = { nullptr, nullptr, nullptr };
+              prepare_filter(&probe, dec_ctx, enc_ctx, spec.c_str());
+              enc_ctx->width = av_buffersink_get_w(probe.buffersink_ctx);
+              enc_ctx->height = av_buffersink_get_h(probe.buffersink_ctx);
+              enc_ctx->sample_aspect_ratio = av_buffersink_get_sample_aspect_ratio(probe.buffersink_ctx);
+              AVRational frame_rate = av_buffersink_get_frame_rate(probe.buffersink_ctx);
+              if (frame_rate.num > 0 && frame_rate.den > 0) {
+                enc_ctx->time_base = av_inv_q(frame_rate);
+              }
+              avfilter_graph_free(&probe.filter_graph);
+            }
+            filter_time_base_[i] = enc_ctx->time_base;
+
           } else {
             enc_ctx->sample_rate = dec_ctx->sample_rate;
             if (dec_ctx->channels && !dec_ctx->channel_layout) {
@@ -327,47 +1589,346 @@ namespace ben {
             enc_ctx->time_base.den = enc_ctx->sample_rate;
           }
 
-          chk(
-            avcodec_open2(enc_ctx, enc, NULL),
-            "output avcodec_open2"
-          );
+          // before open : the encoder puts sps/pps into extradata only then
+          if (ofmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER) {
+            enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+          }
+
+          AVDictionary* enc_opts = nullptr;
+          if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+            EncoderSetup::apply(encoder_config_, enc, enc_ctx, &enc_opts);
+          }
+          int ret = avcodec_open2(enc_ctx, enc, &enc_opts);
+          EncoderSetup::report_unused(enc_opts, enc);
+          av_dict_free(&enc_opts);
+          if (ret < 0) {
+            avcodec_free_context(&enc_ctx);
+          }
+          chk(ret, "output avcodec_open2 : %s", enc->name);
+
+          chk(
+            avcodec_parameters_from_context(out_stream->codecpar, enc_ctx),
+            "output avcodec_parameters_from_context"
+          );
+
+          out_stream->time_base = enc_ctx->time_base;
+          stream_ctx_[i].enc_ = enc_ctx;
+
+        } else if (dec_ctx->codec_type == AVMEDIA_TYPE_UNKNOWN) {
+          chk(AVERROR_INVALIDDATA, "dec_ctx->codec_type == AVMEDIA_TYPE_UNKNOWN");
+        } else {
+          // remux
+          chk(
+            avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar),
+            "output avcodec_parameters_copy"
+          );
+          out_stream->time_base = in_stream->time_base;
+        }
+      }
+      for (auto& it : rendition_config_) {
+        prepare_rendition_output(it.first, it.second);
+      }
+      //av_dump_format(ofmt_ctx_, 0, output_filename.c_str(), 1);
+
+      open_output(ofmt_ctx_, output_filename);
+
+      out_time_base_.clear();
+      segment_key_stream_ = -1;
+      for (unsigned int i = 0; i < ofmt_ctx_->nb_streams; i++) {
+        out_time_base_.push_back(ofmt_ctx_->streams[i]->time_base);
+        if (segment_key_stream_ < 0 && ofmt_ctx_->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+          segment_key_stream_ = i;
+        }
+      }
+
+      if (segmented()) {
+        segment_offset_.assign(ofmt_ctx_->nb_streams, AV_NOPTS_VALUE);
+        segment_format_ = ofmt_ctx_->oformat;
+        for (auto& par : segment_params_) {
+          avcodec_parameters_free(&par);
+        }
+        segment_params_.clear();
+        for (unsigned int i = 0; i < ofmt_ctx_->nb_streams; i++) {
+          AVCodecParameters* par = avcodec_parameters_alloc();
+          chk(par, "segment avcodec_parameters_alloc");
+          segment_params_.push_back(par);
+          chk(
+            avcodec_parameters_copy(par, ofmt_ctx_->streams[i]->codecpar),
+            "segment avcodec_parameters_copy[stream: %u]", i
+          );
+        }
+        segment_closer_ = std::thread([this]() {
+          open_next_segment(1);
+        });
+      }
+    }
+
+    // opens the file and writes the header
+    void open_output(AVFormatContext* ctx, const std::string& output_filename)
+    {
+      if (!(ctx->oformat->flags & AVFMT_NOFILE) && async_output_) {
+        AsyncWriter* writer = new AsyncWriter(async_options_);
+        int ret = writer->open(output_filename);
+        if (ret < 0) {
+          delete writer;
+          chk(ret, "output async open : %s", output_filename.c_str());
+        }
+        // freed by free_output
+        ctx->opaque = writer;
+        ctx->pb = writer->avio();
+        ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+      } else if (!(ctx->oformat->flags & AVFMT_NOFILE)) {
+        chk(
+          avio_open(&ctx->pb, output_filename.c_str(), AVIO_FLAG_WRITE),
+          "output avio_open : %s", output_filename.c_str()
+        );
+      }
+
+      AVDictionary* opt = NULL;
+      if (fragmented_) {
+        av_dict_set(&opt, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        if (fragment_ms_ > 0) {
+          av_dict_set_int(&opt, "frag_duration", static_cast<int64_t>(fragment_ms_) * 1000, 0);
+        }
+      }
+
+      // init muxer, write output file header
+      int ret = avformat_write_header(ctx, &opt);
+      av_dict_free(&opt);
+      chk(ret, "output avformat_write_header : %s", output_filename.c_str());
+    }
+
+    bool segmented() const
+    {
+      return segment_ms_ > 0 || segment_size_ > 0;
+    }
+
+    std::string segment_filename(int index) const
+    {
+      char buf[1024] = { 0, };
+      if (av_get_frame_filename(buf, sizeof(buf), output_filename_.c_str(), index) == 0) {
+        return buf;
+      }
+
+      std::string::size_type dot = output_filename_.find_last_of('.');
+      std::string::size_type slash = output_filename_.find_last_of("/\\");
+      if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = output_filename_.size();
+      }
+      snprintf(buf, sizeof(buf), "_%03d", index);
+      return output_filename_.substr(0, dot) + buf + output_filename_.substr(dot);
+    }
+
+    // mux thread. true when packet has to start the next segment.
+    bool segment_full(ff::Packet& packet)
+    {
+      int stream_index = packet->stream_index;
+      if (segment_key_stream_ >= 0) {
+        if (stream_index != segment_key_stream_ || !(packet->flags & AV_PKT_FLAG_KEY)) {
+          return false;
+        }
+      }
+
+      if (segment_start_pts_ == AV_NOPTS_VALUE && packet->pts != AV_NOPTS_VALUE) {
+        segment_start_pts_ = packet->pts;
+      }
+
+      if (segment_size_ > 0 && ofmt_ctx_->pb && avio_tell(ofmt_ctx_->pb) >= segment_size_) {
+        return true;
+      }
+
+      if (segment_ms_ > 0) {
+        int64_t elapsed_ms = 0;
+        if (packet->pts != AV_NOPTS_VALUE && segment_start_pts_ != AV_NOPTS_VALUE) {
+          elapsed_ms = av_rescale_q(
+            packet->pts - segment_start_pts_,
+            out_time_base_[stream_index],
+            AVRational{ 1, 1000 }
+          );
+        } else {
+          elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - segment_start_
+          ).count();
+        }
+        if (elapsed_ms >= segment_ms_) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // mux thread. swaps in the segment opened ahead, the previous one is
+    // finished (trailer, close) on segment_closer_, which then opens the next.
+    void roll_segment()
+    {
+      // the closer has had a whole segment to do both
+      join_segment_closer();
+      AVFormatContext* ctx = next_segment_;
+      next_segment_ = nullptr;
+      chk(ctx, "segment open : %s", next_segment_err_.c_str());
+
+      AVFormatContext* prev = ofmt_ctx_;
+      ofmt_ctx_ = ctx;
+      segment_index_++;
+      segment_start_pts_ = AV_NOPTS_VALUE;
+      segment_start_ = std::chrono::steady_clock::now();
+      segment_offset_.assign(segment_offset_.size(), AV_NOPTS_VALUE);
+      for (auto& rendition : renditions_) {
+        rendition->force_key = true;
+      }
+
+      int next = segment_index_ + 1;
+      segment_closer_ = std::thread([this, prev, next]() {
+        int ret = av_write_trailer(prev);
+        if (ret < 0) {
+          av_log(nullptr, AV_LOG_ERROR, "segment av_write_trailer : %d\n", ret);
+        }
+        free_output(prev);
+        open_next_segment(next);
+      });
+    }
 
+    // segment_closer_. a failure shows at the next rollover (next_segment_err_).
+    void open_next_segment(int index)
+    {
+      std::string filename = segment_filename(index);
+      AVFormatContext* ctx = nullptr;
+      try {
+        chk(
+          avformat_alloc_output_context2(&ctx, segment_format_, NULL, filename.c_str()),
+          "segment avformat_alloc_output_context2 : %s", filename.c_str()
+        );
+        for (unsigned int i = 0; i < segment_params_.size(); i++) {
+          AVStream* out_stream = avformat_new_stream(ctx, NULL);
+          chk(out_stream, "segment avformat_new_stream[stream: %u]", i);
           chk(
-            avcodec_parameters_from_context(out_stream->codecpar, enc_ctx),
-            "output avcodec_parameters_from_context"
+            avcodec_parameters_copy(out_stream->codecpar, segment_params_[i]),
+            "segment avcodec_parameters_copy[stream: %u]", i
           );
+          out_stream->time_base = out_time_base_[i];
+        }
+        open_output(ctx, filename);
+      } catch (std::runtime_error& e) {
+        free_output(ctx);
+        ctx = nullptr;
+        next_segment_err_ = e.what();
+      }
+      next_segment_ = ctx;
+      next_segment_name_ = filename;
+    }
 
-          if (ofmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER) {
-            enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-          }
-          out_stream->time_base = enc_ctx->time_base;
-          stream_ctx_[i].enc_ = enc_ctx;
+    // after the last segment : the one opened ahead goes, with its file
+    void discard_next_segment()
+    {
+      if (!next_segment_) {
+        return;
+      }
+      bool file = !(next_segment_->oformat->flags & AVFMT_NOFILE);
+      free_output(next_segment_);
+      next_segment_ = nullptr;
+      if (file) {
+        std::remove(next_segment_name_.c_str());
+      }
+    }
 
-        } else if (dec_ctx->codec_type == AVMEDIA_TYPE_UNKNOWN) {
-          chk(AVERROR_INVALIDDATA, "dec_ctx->codec_type == AVMEDIA_TYPE_UNKNOWN");
-        } else {
-          // remux
-          chk(
-            avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar),
-            "output avcodec_parameters_copy"
-          );
-          out_stream->time_base = in_stream->time_base;
+    // like the segment muxer's reset_timestamps : one start time for the segment,
+    // its first packet (after a rollover the keyframe), subtracted from every
+    // stream in its own time base. streams keep their distance to each other.
+    void rebase_segment(ff::Packet& packet)
+    {
+      if (segment_offset_[packet->stream_index] == AV_NOPTS_VALUE) {
+        int64_t start = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+        if (start == AV_NOPTS_VALUE) {
+          return;
+        }
+        AVRational time_base = out_time_base_[packet->stream_index];
+        for (std::size_t i = 0; i < segment_offset_.size(); i++) {
+          segment_offset_[i] = av_rescale_q(start, time_base, out_time_base_[i]);
         }
       }
-      //av_dump_format(ofmt_ctx_, 0, output_filename.c_str(), 1);
+      int64_t offset = segment_offset_[packet->stream_index];
+      if (packet->pts != AV_NOPTS_VALUE) {
+        packet->pts -= offset;
+      }
+      if (packet->dts != AV_NOPTS_VALUE) {
+        packet->dts -= offset;
+      }
+    }
 
-      if (!(ofmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
-        chk(
-          avio_open(&ofmt_ctx_->pb, output_filename.c_str(), AVIO_FLAG_WRITE),
-          "output avio_open : %s", output_filename.c_str()
-        );
+    void join_segment_closer()
+    {
+      if (segment_closer_.joinable()) {
+        segment_closer_.join();
+      }
+    }
+
+    // encoder pixel format closest to src (the filter input) :
+    // src itself, else its yuv name when src is yuvj (same planes, range kept as
+    // metadata : returns true, frames get renamed), else the least lossy one.
+    // anything else is a conversion in the filter graph and is reported.
+    bool negotiate_pix_fmt(
+      const AVCodec* enc,
+      AVPixelFormat src,
+      AVColorRange src_range,
+      AVCodecContext* enc_ctx,
+      unsigned int output_stream
+    ) {
+      bool full = ff::PixFmt::is_full(src, src_range);
+      AVPixelFormat limited = ff::PixFmt::limited(src);
+
+      if (ff::PixFmt::supported(enc->pix_fmts, src)) {
+        enc_ctx->pix_fmt = src;
+        enc_ctx->color_range = full ? AVCOL_RANGE_JPEG : src_range;
+        return false;
+      }
+      if (limited != src && ff::PixFmt::supported(enc->pix_fmts, limited)) {
+        enc_ctx->pix_fmt = limited;
+        enc_ctx->color_range = AVCOL_RANGE_JPEG;
+        return true;
       }
 
-      // init muxer, write output file header
-      chk(
-        avformat_write_header(ofmt_ctx_, NULL),
-        "output avformat_write_header"
+      enc_ctx->pix_fmt = avcodec_find_best_pix_fmt_of_list(enc->pix_fmts, src, 0, nullptr);
+      // the scaler outputs limited range unless the format is yuvj
+      if (ff::PixFmt::is_jpeg(enc_ctx->pix_fmt)) {
+        enc_ctx->color_range = AVCOL_RANGE_JPEG;
+      } else {
+        enc_ctx->color_range = full ? AVCOL_RANGE_MPEG : src_range;
+      }
+
+      FormatConversion conversion;
+      conversion.output_stream = output_stream;
+      conversion.from = src;
+      conversion.to = enc_ctx->pix_fmt;
+      conversion.from_range = full ? AVCOL_RANGE_JPEG : src_range;
+      conversion.to_range = enc_ctx->color_range;
+      conversions_.push_back(conversion);
+
+      av_log(
+        nullptr, AV_LOG_WARNING,
+        "output stream %u : %s has no %s, converting to %s%s on every frame\n",
+        output_stream, enc->name,
+        av_get_pix_fmt_name(src), av_get_pix_fmt_name(enc_ctx->pix_fmt),
+        full && enc_ctx->color_range != AVCOL_RANGE_JPEG ? " (full to limited range)" : ""
       );
+      return false;
+    }
+
+    bool use_copy(unsigned int stream_index, AVCodecID enc_id)
+    {
+      StreamMode mode = StreamMode::Auto;
+      auto it = stream_mode_.find(stream_index);
+      if (it != stream_mode_.end()) {
+        mode = it->second;
+      }
+
+      switch (mode) {
+      case StreamMode::Copy: return true;
+      case StreamMode::Encode: return false;
+      default: break;
+      }
+
+      // without a filter, same codec means same output
+      return enc_id == stream_ctx_[stream_index].dec_->codec_id && passthrough(filter_spec(stream_index));
     }
 
     void prepare_filter()
@@ -375,6 +1936,10 @@ namespace ben {
       filter_ctx_ = (ff::FilteringContext*)av_malloc_array(ifmt_ctx_->nb_streams, sizeof(*filter_ctx_));
       chk(filter_ctx_, "filter av_malloc_array");
 
+      filter_active_.assign(ifmt_ctx_->nb_streams, std::string());
+      filtered_.assign(ifmt_ctx_->nb_streams, false);
+      bypass_.assign(ifmt_ctx_->nb_streams, false);
+      filter_changed_ = false;
 
       for (unsigned int i = 0; i < ifmt_ctx_->nb_streams; i++) {
         filter_ctx_[i].buffersrc_ctx = nullptr;
@@ -389,28 +1954,193 @@ namespace ben {
           continue;
         }
 
-        //passthrough (dummy) filter
-        const char* filter_spec = nullptr;
-        if (codec_type == AVMEDIA_TYPE_VIDEO) {
-          filter_spec = "null";
-        } else {
-          filter_spec = "anull";
+        if (stream_ctx_[i].copy_ && !has_renditions(i)) {
+          continue;
+        }
+
+        build_filter(i, filter_spec(i), false);
+        filtered_[i] = true;
+      }
+
+      start_renditions();
+    }
+
+    std::string filter_spec(unsigned int stream_index)
+    {
+      std::lock_guard<std::mutex> lock(filter_mutex_);
+      auto it = filter_spec_.find(stream_index);
+      return it != filter_spec_.end() ? it->second : std::string();
+    }
+
+    // decoded frames of this stream go to the encoders (through a graph or not).
+    // read by the decoding thread, a rebuild on the filtering thread never changes it.
+    bool filtered(unsigned int stream_index) const
+    {
+      return filtered_[stream_index];
+    }
+
+    static bool passthrough(const std::string& spec)
+    {
+      return spec.empty() || spec == "null" || spec == "anull";
+    }
+
+    // encoder open : its size is fixed, the graph output is scaled back to it
+    void build_filter(unsigned int stream_index, const std::string& spec, bool encoder_open)
+    {
+      AVCodecContext* dec_ctx = stream_ctx_[stream_index].dec_;
+      AVCodecContext* enc_ctx = stream_ctx_[stream_index].enc_;
+
+      std::vector<RenditionContext*> renditions;
+      for (auto& rendition : renditions_) {
+        if (rendition->input_index == stream_index) {
+          renditions.push_back(rendition.get());
         }
+      }
+
+      filter_active_[stream_index] = spec;
+      bypass_[stream_index] = passthrough(spec) && renditions.empty() && enc_ctx && passthrough(dec_ctx, enc_ctx);
+      if (bypass_[stream_index]) {
+        return;
+      }
 
+      //passthrough (dummy) filter
+      std::string chain = spec;
+      if (chain.empty()) {
+        chain = dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ? "null" : "anull";
+      }
+
+      ff::FilteringContext* fctx = &filter_ctx_[stream_index];
+      prepare_filter(
+        fctx,
+        dec_ctx, // ifmt_ctx_->streams[i]->codec
+        enc_ctx, // ofmt_ctx_->streams[i]->codec, null : copied
+        rendition_spec(chain.c_str(), enc_ctx != nullptr, renditions).c_str(),
+        renditions
+      );
+
+      if (
+        encoder_open && enc_ctx && dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO &&
+        (av_buffersink_get_w(fctx->buffersink_ctx) != enc_ctx->width ||
+         av_buffersink_get_h(fctx->buffersink_ctx) != enc_ctx->height)
+      ) {
+        avfilter_graph_free(&fctx->filter_graph);
+        chain += ",scale=" + std::to_string(enc_ctx->width) + ":" + std::to_string(enc_ctx->height);
         prepare_filter(
-          &filter_ctx_[i],
-          stream_ctx_[i].dec_, // ifmt_ctx_->streams[i]->codec
-          stream_ctx_[i].enc_, // ofmt_ctx_->streams[i]->codec
-          filter_spec
+          fctx, dec_ctx, enc_ctx,
+          rendition_spec(chain.c_str(), true, renditions).c_str(),
+          renditions
         );
       }
     }
+
+    // the encoder takes decoded frames as they are
+    static bool passthrough(AVCodecContext* dec_ctx, AVCodecContext* enc_ctx)
+    {
+      if (dec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        return
+          filter_pix_fmt(dec_ctx, enc_ctx) == enc_ctx->pix_fmt &&
+          dec_ctx->width == enc_ctx->width &&
+          dec_ctx->height == enc_ctx->height;
+      }
+      return
+        dec_ctx->sample_fmt == enc_ctx->sample_fmt &&
+        dec_ctx->sample_rate == enc_ctx->sample_rate &&
+        dec_ctx->channel_layout == enc_ctx->channel_layout;
+    }
+
+    // format of the frames going into the filter : yuvj renamed to yuv
+    // when the encoder takes the yuv name only (see negotiate_pix_fmt)
+    static AVPixelFormat filter_pix_fmt(AVCodecContext* dec_ctx, AVCodecContext* enc_ctx)
+    {
+      AVPixelFormat limited = ff::PixFmt::limited(dec_ctx->pix_fmt);
+      if (enc_ctx && enc_ctx->pix_fmt == limited) {
+        return limited;
+      }
+      return dec_ctx->pix_fmt;
+    }
+
+    // a decoded frame the encoder takes as it is (bypass)
+    static bool passthrough(const AVFrame* frame, AVCodecContext* enc_ctx)
+    {
+      if (enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        return
+          frame->format == enc_ctx->pix_fmt &&
+          frame->width == enc_ctx->width &&
+          frame->height == enc_ctx->height;
+      }
+      return
+        frame->format == enc_ctx->sample_fmt &&
+        frame->sample_rate == enc_ctx->sample_rate &&
+        frame->channel_layout == enc_ctx->channel_layout;
+    }
+
+    // on the filtering thread : specs changed by set_filter
+    void apply_filter_changes()
+    {
+      std::map<unsigned int, std::string> specs;
+      {
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        specs = filter_spec_;
+        filter_changed_ = false;
+      }
+
+      for (auto& it : specs) {
+        unsigned int i = it.first;
+        if (i >= ifmt_ctx_->nb_streams || !filtered(i) || it.second == filter_active_[i]) {
+          continue;
+        }
+        rebuild_filter(i, it.second);
+      }
+    }
+
+    void rebuild_filter(unsigned int stream_index, const std::string& spec)
+    {
+      ff::FilteringContext& fctx = filter_ctx_[stream_index];
+      if (fctx.filter_graph) {
+        // what already came out goes on. not flushed : that would end the encoders.
+        chk(pull_filter(stream_index, false), "filter rebuild[stream: %u]", stream_index);
+        avfilter_graph_free(&fctx.filter_graph);
+        fctx.buffersrc_ctx = nullptr;
+        fctx.buffersink_ctx = nullptr;
+      }
+      build_filter(stream_index, spec, true);
+    }
+
+    // [in]spec,split=n[out][r0][r1]
+    // the main output ("out") is left out when the stream is copied.
+    // no scale here : lavfi scale runs on the filter thread alone, renditions
+    // scale in slices on their encoder thread (scale_rendition).
+    std::string rendition_spec(
+      const char* filter_spec,
+      bool main,
+      const std::vector<RenditionContext*>& renditions
+    ) {
+      if (renditions.empty()) {
+        return filter_spec;
+      }
+
+      std::string spec = "[in]";
+      spec += main ? filter_spec : "null";
+
+      std::size_t outputs = renditions.size() + (main ? 1 : 0);
+      if (outputs > 1) {
+        spec += ",split=" + std::to_string(outputs);
+      }
+      if (main) {
+        spec += "[out]";
+      }
+      for (std::size_t i = 0; i < renditions.size(); i++) {
+        spec += "[r" + std::to_string(i) + "]";
+      }
+      return spec;
+    }
     
     void prepare_filter(
       ff::FilteringContext* fctx,
       AVCodecContext* dec_ctx,
       AVCodecContext* enc_ctx,
-      const char* filter_spec)
+      const char* filter_spec,
+      const std::vector<RenditionContext*>& renditions = std::vector<RenditionContext*>())
     {
       AVFilterContext* buffersrc_ctx = nullptr;
       AVFilterContext* buffersink_ctx = nullptr;
@@ -435,7 +2165,7 @@ namespace ben {
           snprintf(
             args, sizeof(args),
             "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-            dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
+            dec_ctx->width, dec_ctx->height, filter_pix_fmt(dec_ctx, enc_ctx),
             dec_ctx->time_base.num, dec_ctx->time_base.den,
             dec_ctx->sample_aspect_ratio.num,
             dec_ctx->sample_aspect_ratio.den
@@ -446,26 +2176,30 @@ namespace ben {
             "filter video in avfilter_graph_create_filter"
           );
 
-          chk(
-            avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", NULL, NULL, filter_graph),
-            "filter video out avfilter_graph_create_filter"
-          );
+          if (enc_ctx) {
+            chk(
+              avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", NULL, NULL, filter_graph),
+              "filter video out avfilter_graph_create_filter"
+            );
+          }
 
+          for (std::size_t i = 0; i < renditions.size(); i++) {
+            RenditionContext* rendition = renditions[i];
+            std::string name = "r" + std::to_string(i);
+            chk(
+              avfilter_graph_create_filter(&rendition->buffersink_ctx, buffersink, name.c_str(), NULL, NULL, filter_graph),
+              "filter rendition avfilter_graph_create_filter"
+            );
+            // any format : a conversion here would be a scale filter again
+          }
 
-          //warning message occurred
-          //[swscaler @ 0000026336eaa520] deprecated pixel format used, make sure you did set range correctly
-          //switch (enc_ctx->pix_fmt) {
-          //case AV_PIX_FMT_YUVJ420P: enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P; break;
-          //case AV_PIX_FMT_YUVJ422P: enc_ctx->pix_fmt = AV_PIX_FMT_YUV422P; break;
-          //case AV_PIX_FMT_YUVJ444P: enc_ctx->pix_fmt = AV_PIX_FMT_YUV444P; break;
-          //case AV_PIX_FMT_YUVJ440P: enc_ctx->pix_fmt = AV_PIX_FMT_YUV440P; break;
-          //default: break;
-          //}
 
-          chk(
-            av_opt_set_bin(buffersink_ctx, "pix_fmts", (uint8_t*)&enc_ctx->pix_fmt, sizeof(enc_ctx->pix_fmt), AV_OPT_SEARCH_CHILDREN),
-            "filter video pix_fmts av_opt_set_bin "
-          );
+          if (enc_ctx) {
+            chk(
+              av_opt_set_bin(buffersink_ctx, "pix_fmts", (uint8_t*)&enc_ctx->pix_fmt, sizeof(enc_ctx->pix_fmt), AV_OPT_SEARCH_CHILDREN),
+              "filter video pix_fmts av_opt_set_bin "
+            );
+          }
 
         } else if (dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
 
@@ -524,11 +2258,24 @@ namespace ben {
         outputs->next = NULL;
         chk(outputs->name, "filter audio outputs name");
 
-        inputs->name = av_strdup("out");
-        inputs->filter_ctx = buffersink_ctx;
-        inputs->pad_idx = 0;
-        inputs->next = NULL;
-        chk(inputs->name, "filter audio inputs name");
+        // main sink first ("out"), then one per rendition ("r0", "r1" ...)
+        AVFilterInOut* input = inputs;
+        for (std::size_t i = 0; i <= renditions.size(); i++) {
+          bool main = i == 0;
+          if (main && !buffersink_ctx) {
+            continue;
+          }
+          if (input->name) {
+            input->next = avfilter_inout_alloc();
+            chk(input->next, "filter rendition avfilter_inout_alloc");
+            input = input->next;
+          }
+          input->name = av_strdup(main ? "out" : ("r" + std::to_string(i - 1)).c_str());
+          input->filter_ctx = main ? buffersink_ctx : renditions[i - 1]->buffersink_ctx;
+          input->pad_idx = 0;
+          input->next = NULL;
+          chk(input->name, "filter audio inputs name");
+        }
 
         chk(
           avfilter_graph_parse_ptr(filter_graph, filter_spec, &inputs, &outputs, NULL),
@@ -548,67 +2295,394 @@ namespace ben {
       } catch (std::runtime_error& e) {
         avfilter_inout_free(&inputs);
         avfilter_inout_free(&outputs);
+        avfilter_graph_free(&filter_graph);
         throw e;
       }
     }
 
 
-    void filter_encode_write_frame(ff::Frame& frame, unsigned int stream_index)
+    // frame == nullptr flushes the filter graph
+    int filter_encode_write_frame(AVFrame* frame, unsigned int stream_index)
     {
-      chk(
-        av_buffersrc_add_frame_flags(filter_ctx_[stream_index].buffersrc_ctx, frame, 0),
-        "av_buffersrc_add_frame_flags"
-      );
+      if (filter_changed_ && frame) {
+        // builds graphs : setup code, may throw
+        try {
+          apply_filter_changes();
+        } catch (std::runtime_error& e) {
+          fail(e);
+          return AVERROR_EXTERNAL;
+        }
+      }
+
+      if (bypass_[stream_index]) {
+        if (!frame) {
+          // nothing buffered, the encoder is flushed by the caller
+          return 0;
+        }
+        if (passthrough(frame, stream_ctx_[stream_index].enc_)) {
+          frame->pict_type = AV_PICTURE_TYPE_NONE;
+          return encode_write_frame(frame, stream_index);
+        }
+        // decoder output changed : convert from now on
+        try {
+          rebuild_filter(stream_index, std::string());
+        } catch (std::runtime_error& e) {
+          fail(e);
+          return AVERROR_EXTERNAL;
+        }
+        if (bypass_[stream_index]) {
+          return error(AVERROR(EINVAL), "decoded frame does not match its codec context");
+        }
+      }
+
+      int ret;
+      {
+        StageTimer timer(stats_.stage(Stage::Filter));
+        ret = av_buffersrc_add_frame_flags(filter_ctx_[stream_index].buffersrc_ctx, frame, 0);
+      }
+      if (ret < 0) {
+        return error(ret, "av_buffersrc_add_frame_flags");
+      }
+
+      return pull_filter(stream_index, frame == nullptr);
+    }
+
+    // filtered frames to the encoders
+    int pull_filter(unsigned int stream_index, bool flush)
+    {
+      for (auto& rendition : renditions_) {
+        if (rendition->input_index == stream_index) {
+          int ret = pull_rendition(*rendition, flush);
+          if (ret < 0) {
+            return ret;
+          }
+        }
+      }
+
+      if (!filter_ctx_[stream_index].buffersink_ctx) {
+        // copied stream, filtered for renditions only
+        return 0;
+      }
 
       // pull filtered frames from the filtergraph
+      ff::Frame& filt_frame = filt_frame_;
       while (true) {
-        ff::Frame filt_frame;
         int ret = av_buffersink_get_frame(filter_ctx_[stream_index].buffersink_ctx, filt_frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+          return 0;
+        }
         if (ret < 0) {
-          if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            ret = 0;
-          }
-          chk(ret, "av_buffersink_get_frame");
-          return;
+          return error(ret, "av_buffersink_get_frame");
         }
 
         filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
-        encode_write_frame(filt_frame, stream_index);
+        ret = encode_write_frame(filt_frame, stream_index);
+        filt_frame.unref();
+        if (ret < 0) {
+          return ret;
+        }
+      }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // renditions
+
+    void prepare_rendition_output(unsigned int input_index, const Rendition& config)
+    {
+      AVCodecContext* dec_ctx = stream_ctx_[input_index].dec_;
+      if (dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO) {
+        chk(AVERROR(EINVAL), "rendition of a non video stream[stream: %u]", input_index);
+      }
+
+      std::unique_ptr<RenditionContext> rendition(new RenditionContext());
+      rendition->config = config;
+      rendition->input_index = input_index;
+
+      AVStream* out_stream = avformat_new_stream(ofmt_ctx_, NULL);
+      chk(out_stream, "rendition avformat_new_stream[stream: %u]", input_index);
+      rendition->output_index = out_stream->index;
+
+      AVCodecID codec_id = config.codec_id;
+      if (codec_id == AV_CODEC_ID_NONE) {
+        codec_id = ofmt_ctx_->streams[input_index]->codecpar->codec_id;
+      }
+      AVCodec* enc = avcodec_find_encoder(codec_id);
+      chk(enc, "rendition avcodec_find_encoder");
+
+      AVCodecContext* enc_ctx = avcodec_alloc_context3(enc);
+      chk(enc_ctx, "rendition avcodec_alloc_context3");
+      rendition->enc_ = enc_ctx;
+
+      // relative to the main stream, after its filter
+      const AVCodecParameters* main_par = ofmt_ctx_->streams[input_index]->codecpar;
+      int width = config.width;
+      int height = config.height;
+      if (!width && !height) {
+        width = main_par->width;
+        height = main_par->height;
+      } else if (!width) {
+        width = static_cast<int>(av_rescale(main_par->width, height, main_par->height)) & ~1;
+      } else if (!height) {
+        height = static_cast<int>(av_rescale(main_par->height, width, main_par->width)) & ~1;
+      }
+
+      enc_ctx->width = width;
+      enc_ctx->height = height;
+      enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+      // from the frames the filter gets : renamed when the main encoder asked for it
+      AVPixelFormat src = dec_ctx->pix_fmt;
+      AVColorRange src_range = dec_ctx->color_range;
+      if (relabel_[input_index]) {
+        src = ff::PixFmt::limited(src);
+        src_range = AVCOL_RANGE_JPEG;
       }
+      negotiate_pix_fmt(enc, src, src_range, enc_ctx, out_stream->index);
+      enc_ctx->colorspace = dec_ctx->colorspace;
+      enc_ctx->color_primaries = dec_ctx->color_primaries;
+      enc_ctx->color_trc = dec_ctx->color_trc;
+      // frames come out of the main chain (fps=15 ...) : its time base, not the camera's.
+      // a copied stream has no chain ("null" before the split) : the camera rate.
+      enc_ctx->time_base = filter_time_base_[input_index];
+      if (enc_ctx->time_base.num == 0) {
+        enc_ctx->time_base = av_inv_q(dec_ctx->framerate);
+      }
+      if (ofmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER) {
+        enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+      }
+
+      // tuned like the main encoder, own rate
+      EncoderConfig encoder_config = encoder_config_;
+      if (config.bit_rate > 0) {
+        encoder_config.bit_rate = config.bit_rate;
+        encoder_config.crf = -1;
+      }
+      AVDictionary* enc_opts = nullptr;
+      EncoderSetup::apply(encoder_config, enc, enc_ctx, &enc_opts);
+      int ret = avcodec_open2(enc_ctx, enc, &enc_opts);
+      EncoderSetup::report_unused(enc_opts, enc);
+      av_dict_free(&enc_opts);
+      chk(ret, "rendition avcodec_open2 : %s", enc->name);
+      chk(
+        avcodec_parameters_from_context(out_stream->codecpar, enc_ctx),
+        "rendition avcodec_parameters_from_context"
+      );
+      out_stream->time_base = enc_ctx->time_base;
 
+      rendition->frames = new SpscQueue<StageItem>(queue_size_);
+      rendition->packets = new SpscQueue<ff::Packet>(queue_size_);
+      renditions_.push_back(std::move(rendition));
     }
 
-    void encode_write_frame(ff::Frame& filt_frame, unsigned int stream_index) {
-      // encode filtered frame
-      AVPacket enc_pkt;
-      enc_pkt.data = NULL;
-      enc_pkt.size = 0;
-      av_init_packet(&enc_pkt);
+    void start_renditions()
+    {
+      for (auto& rendition : renditions_) {
+        rendition->stop = false;
+        rendition->done = false;
+        rendition->written = 0;
+        rendition->dropped = 0;
+        rendition->thread = std::thread(&Webcam::rendition_stage, this, rendition.get());
+      }
+    }
 
-      chk(avcodec_send_frame(stream_ctx_[stream_index].enc_, filt_frame), "out avcodec_send_frame");
+    // waits for the encoder threads. after a flush they end on their own.
+    // the muxing is over by now : their last packets are muxed here.
+    void stop_renditions()
+    {
+      for (auto& rendition : renditions_) {
+        rendition->stop = true;
+      }
+      for (auto& rendition : renditions_) {
+        while (rendition->thread.joinable() && !rendition->done) {
+          // a full packet queue holds the encoder thread
+          drain_renditions();
+          std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+        if (rendition->thread.joinable()) {
+          rendition->thread.join();
+        }
+      }
+      drain_renditions();
+    }
 
-      int ret = 0;
-      while (ret >= 0) {
-        // encode
-        ret = avcodec_receive_packet(stream_ctx_[stream_index].enc_, &enc_pkt);
+    void drain_renditions()
+    {
+      std::lock_guard<std::mutex> lock(mux_mutex_);
+      if (failed_ || !ofmt_ctx_) {
+        for (auto& rendition : renditions_) {
+          while (rendition->packets && rendition->packets->pop(rendition_packet_)) {
+            rendition_packet_.unref();
+          }
+        }
+        return;
+      }
+      mux_renditions();
+    }
+
+    // filter thread : hands filtered frames to the rendition encoder.
+    // never waits for it : a full queue drops the frame for this rendition only.
+    int pull_rendition(RenditionContext& rendition, bool flush)
+    {
+      while (true) {
+        int ret = av_buffersink_get_frame(rendition.buffersink_ctx, rendition.filt_frame);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-          return;
+          break;
+        }
+        if (ret < 0) {
+          return error(ret, "rendition av_buffersink_get_frame");
+        }
+
+        rendition.filt_frame->pict_type = AV_PICTURE_TYPE_NONE;
+        bool pushed = rendition.frames->push_with([&](StageItem& slot) {
+          slot.frame = std::move(rendition.filt_frame);
+          slot.has_frame = true;
+        });
+        if (!pushed) {
+          rendition.filt_frame.unref();
+          rendition.dropped++;
+        }
+      }
+
+      if (flush) {
+        // must get through : the encoder thread may wait for the muxer itself
+        auto fill = [&](StageItem& slot) {
+          slot.frame.unref();
+          slot.has_frame = false;
+        };
+        while (!rendition.frames->push_with(fill)) {
+          if (failed_) {
+            return AVERROR_EXIT;
+          }
+          drain_renditions();
+          std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+      }
+      return 0;
+    }
+
+    void rendition_stage(RenditionContext* rendition)
+    {
+      try {
+        StageItem item;
+        while (pop_stage(*rendition->frames, item, rendition->stop)) {
+          if (!item.has_frame) {
+            encode_rendition(*rendition, nullptr);
+            break;
+          }
+          AVFrame* frame = scale_rendition(*rendition, item.frame);
+          if (rendition->force_key.exchange(false)) {
+            frame->pict_type = AV_PICTURE_TYPE_I;
+          }
+          int ret = encode_rendition(*rendition, frame);
+          item.frame.unref();
+          rendition->scaled.unref();
+          if (ret < 0) {
+            break;
+          }
+        }
+      } catch (std::runtime_error& e) {
+        fail(e);
+      }
+      rendition->done = true;
+    }
+
+    // encoder thread : main chain output to the encoder size, format and range.
+    // in slices on a few cores, the frame itself when nothing changes.
+    AVFrame* scale_rendition(RenditionContext& rendition, AVFrame* frame)
+    {
+      const AVCodecContext* enc_ctx = rendition.enc_;
+      AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+      if (
+        frame->width == enc_ctx->width && frame->height == enc_ctx->height && format == enc_ctx->pix_fmt &&
+        ff::PixFmt::is_full(format, frame->color_range) == ff::PixFmt::is_full(enc_ctx->pix_fmt, enc_ctx->color_range)
+      ) {
+        return frame;
+      }
+
+      ff::Frame& scaled = rendition.scaled;
+      chk(
+        scaled.get_buffer(rendition.scaled_pool, enc_ctx->pix_fmt, enc_ctx->width, enc_ctx->height, ff::Frame::simd_align),
+        "rendition frame buffer"
+      );
+      ff::Frame::copy_props(frame, scaled);
+      scaled->color_range = enc_ctx->color_range;
+      rendition.scaler.scale(frame, scaled);
+      return scaled;
+    }
+
+    // frame == nullptr flushes the encoder
+    int encode_rendition(RenditionContext& rendition, AVFrame* frame)
+    {
+      // queued for the muxing thread, whatever the mode
+      return encode(rendition.enc_, frame, rendition.output_index, rendition.packets);
+    }
+
+    // filt_frame == nullptr flushes the encoder
+    int encode_write_frame(AVFrame* filt_frame, unsigned int stream_index)
+    {
+      return encode(stream_ctx_[stream_index].enc_, filt_frame, stream_index, nullptr);
+    }
+
+    // packets : rendition queue (waits for the muxing thread), nullptr : write_packet
+    int encode(AVCodecContext* enc_ctx, AVFrame* frame, unsigned int output_index, SpscQueue<ff::Packet>* packets)
+    {
+      ff::Packet enc_pkt;
+
+      // muxing is timed by its own stage
+      StageTimer timer(stats_.stage(Stage::Encode));
+      int ret = avcodec_send_frame(enc_ctx, frame);
+      if (ret == AVERROR(EAGAIN)) {
+        // packets not taken yet : take them, then the frame fits
+        ret = receive_packets(enc_ctx, enc_pkt, output_index, packets, timer);
+        if (ret < 0) {
+          return ret;
+        }
+        ret = avcodec_send_frame(enc_ctx, frame);
+      }
+      if (ret < 0) {
+        return error(ret, "avcodec_send_frame");
+      }
+
+      return receive_packets(enc_ctx, enc_pkt, output_index, packets, timer);
+    }
+
+    // every packet the encoder has ready, until EAGAIN / EOF
+    int receive_packets(
+      AVCodecContext* enc_ctx,
+      ff::Packet& enc_pkt,
+      unsigned int output_index,
+      SpscQueue<ff::Packet>* packets,
+      StageTimer& timer
+    ) {
+      while (true) {
+        int ret = avcodec_receive_packet(enc_ctx, enc_pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+          return 0;
+        }
+        if (ret < 0) {
+          return error(ret, "avcodec_receive_packet");
         }
-        chk(ret, "out avcodec_receive_packet");
 
         // prepare packet for muxing
-        enc_pkt.stream_index = stream_index;
+        enc_pkt->stream_index = output_index;
         av_packet_rescale_ts(
-          &enc_pkt,
-          stream_ctx_[stream_index].enc_->time_base,
-          ofmt_ctx_->streams[stream_index]->time_base
+          enc_pkt,
+          enc_ctx->time_base,
+          out_time_base_[output_index]
         );
 
-        // mux encoded frame
-        chk(
-          av_interleaved_write_frame(ofmt_ctx_, &enc_pkt),
-          "av_interleaved_write_frame"
-        );
+        timer.pause();
+        if (packets) {
+          ret = push_stage(*packets, [&](ff::Packet& slot) {
+            slot = std::move(enc_pkt);
+          });
+        } else {
+          ret = write_packet(enc_pkt);
+        }
+        enc_pkt.unref();
+        timer.resume();
+        if (ret < 0) {
+          return ret;
+        }
       }
     }
 
@@ -0,0 +1,210 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ben {
+
+  enum class Priority
+  {
+    High,
+    Normal,
+    Low
+  };
+
+  static const int priority_count = 3;
+
+
+  // unit of work. not owned by the pool, must outlive its run().
+  class Task
+  {
+  public:
+    virtual ~Task() {}
+    virtual void run() = 0;
+  };
+
+
+  // fixed size work-stealing pool.
+  // every worker has a deque per priority. a worker runs its own tasks in order
+  // (a task resubmitting itself goes behind the others), an idle worker steals
+  // the newest task of another one. the highest priority always goes first.
+  // submit() from a worker goes to its own deque, from any other thread round robin.
+  class WorkerPool
+  {
+  private:
+    struct Worker
+    {
+      std::mutex mutex;
+      std::deque<Task*> tasks[priority_count];
+      std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<bool> running_{ false };
+    std::atomic<std::size_t> pending_{ 0 };
+    std::atomic<std::size_t> next_{ 0 };
+    std::atomic<uint64_t> executed_{ 0 };
+    std::atomic<uint64_t> steals_{ 0 };
+    std::mutex idle_mutex_;
+    std::condition_variable idle_;
+
+  public:
+    // threads : 0 = hardware concurrency
+    explicit WorkerPool(std::size_t threads = 0)
+    {
+      if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+      }
+      for (std::size_t i = 0; i < threads; i++) {
+        workers_.emplace_back(new Worker());
+      }
+      running_ = true;
+      for (std::size_t i = 0; i < threads; i++) {
+        workers_[i]->thread = std::thread(&WorkerPool::run, this, static_cast<int>(i));
+      }
+    }
+
+    ~WorkerPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        running_ = false;
+      }
+      idle_.notify_all();
+      for (auto& worker : workers_) {
+        if (worker->thread.joinable()) {
+          worker->thread.join();
+        }
+      }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void submit(Task* task, Priority priority = Priority::Normal)
+    {
+      int index = current_worker();
+      if (index < 0) {
+        index = static_cast<int>(next_++ % workers_.size());
+      }
+
+      Worker& worker = *workers_[index];
+      {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks[static_cast<int>(priority)].push_back(task);
+      }
+      pending_++;
+
+      std::lock_guard<std::mutex> lock(idle_mutex_);
+      idle_.notify_one();
+    }
+
+    std::size_t size() const
+    {
+      return workers_.size();
+    }
+
+    // tasks waiting to run
+    std::size_t pending() const
+    {
+      return pending_;
+    }
+
+    uint64_t executed() const
+    {
+      return executed_;
+    }
+
+    // tasks a worker took from another worker's deque
+    uint64_t steals() const
+    {
+      return steals_;
+    }
+
+  private:
+    // (pool, index) of the calling thread
+    struct Current
+    {
+      const WorkerPool* pool;
+      int index;
+    };
+
+    static Current& current()
+    {
+      static thread_local Current current = { nullptr, -1 };
+      return current;
+    }
+
+    int current_worker() const
+    {
+      return current().pool == this ? current().index : -1;
+    }
+
+    void run(int index)
+    {
+      current().pool = this;
+      current().index = index;
+
+      while (true) {
+        Task* task = take(index);
+        if (task) {
+          task->run();
+          executed_++;
+          continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idle_mutex_);
+        if (!running_) {
+          break;
+        }
+        idle_.wait_for(lock, std::chrono::milliseconds(10), [this]() {
+          return pending_ > 0 || !running_;
+        });
+      }
+    }
+
+    Task* take(int index)
+    {
+      if (pending_ == 0) {
+        return nullptr;
+      }
+
+      std::size_t count = workers_.size();
+      for (int level = 0; level < priority_count; level++) {
+        // own deque, oldest first
+        {
+          Worker& own = *workers_[index];
+          std::lock_guard<std::mutex> lock(own.mutex);
+          if (!own.tasks[level].empty()) {
+            Task* task = own.tasks[level].front();
+            own.tasks[level].pop_front();
+            pending_--;
+            return task;
+          }
+        }
+
+        // steal from the other end
+        for (std::size_t i = 1; i < count; i++) {
+          Worker& victim = *workers_[(index + i) % count];
+          std::lock_guard<std::mutex> lock(victim.mutex);
+          if (!victim.tasks[level].empty()) {
+            Task* task = victim.tasks[level].back();
+            victim.tasks[level].pop_back();
+            pending_--;
+            steals_++;
+            return task;
+          }
+        }
+      }
+      return nullptr;
+    }
+  };
+}
@@ -2,9 +2,12 @@
 #include "stdafx.h"
 
 #include <ben/devices.h>
+#include <ben/pre_event.h>
 #include <ben/webcam.h>
 
+#if !defined(BEN_HEADLESS)
 #include "example_show_webcam.h"
+#endif
 
 int main(int argc, const char ** argv)
 {
@@ -37,6 +40,28 @@ int main(int argc, const char ** argv)
   printf("--start capture------------\n");
   ben::ff::Log::set_log();
   ben::Webcam wc;
+  //wc.set_pipeline(true);
+  //wc.set_capture_buffer(8, ben::DropPolicy::DropOldest);
+  //wc.set_fragmented(true);
+  //wc.set_segment(10 * 60 * 1000);
+  //wc.set_motion(true);
+  //wc.set_filter(0, "scale=1280:-2,hqdn3d");
+  //ben::Rendition low;
+  //low.height = 360;
+  //wc.add_rendition(0, low);
+  //ben::PreEventSink* pre_event = new ben::PreEventSink(10);
+  //wc.add_sink(std::unique_ptr<ben::Sink>(pre_event));
+  //ben::DecoderConfig decoder;
+  //decoder.thread_count = 4;
+  //wc.set_decoder(0, decoder);
+  //ben::FrameFormat bgr;
+  //bgr.pix_fmt = AV_PIX_FMT_BGR24;
+  //bgr.width = 640;
+  //wc.subscribe(std::unique_ptr<ben::FrameSubscriber>(new ben::CallbackSubscriber("detect", [](ben::ff::Frame& frame) {
+  //  cv::Mat img = ben::MatFrame::bgr(frame); // no copy, shared : read only
+  //})), bgr);
+  //ben::EncoderConfig encoder;
+  //encoder.encoder = "libx264"; // pass as the 4th start_capture argument
   if (!wc.start_capture(
     "USB Video Device",
     "",
@@ -46,7 +71,23 @@ int main(int argc, const char ** argv)
     return -1;
   }
 
+#if defined(_DEBUG)
+  // frame shells and pool buffers (FrameAllocCounter) stop growing after warm-up
+  const uint64_t warm_up = 300; // frames written
+  bool warm = false;
+  uint64_t warm_frames = 0;
+  uint64_t warm_allocs = 0;
+#endif
+
   while (true) {
+#if defined(_DEBUG)
+    if (!warm && wc.stats().frames_out >= warm_up) {
+      warm = true;
+      warm_frames = wc.stats().frames_out;
+      warm_allocs = ben::ff::FrameAllocCounter::count();
+    }
+#endif
+
     if (!wc.capturing()) {
       printf("fail capturing : %s\n", wc.last_err().c_str());
       break;
@@ -59,6 +100,17 @@ int main(int argc, const char ** argv)
     }
   }
 
+#if defined(_DEBUG)
+  if (warm) {
+    // not a heap count : malloc and ffmpeg's own allocations are not seen
+    printf(
+      "frame shell/pool buffer allocations over %llu frames after warm-up : %llu\n",
+      wc.stats().frames_out - warm_frames,
+      ben::ff::FrameAllocCounter::count() - warm_allocs
+    );
+  }
+#endif
+
   printf("\n\nexit...\n");
 
   return 0;
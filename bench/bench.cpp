@@ -0,0 +1,897 @@
+
+// headless throughput / latency benchmark for ben::Webcam.
+//
+// runs the capture pipeline against synthetic lavfi sources (no camera, no window,
+// null muxer) and prints one json document to stdout.
+//
+// usage : bench [--frames N] [--scenario NAME] [--pipeline] [--copy] [--unpaced] [--motion]
+//              [--filter SPEC] [--encoder NAME] [--throughput] [--decode-threads N]
+//        bench --convert [--frames N]
+//   --frames   : frames per scenario (default 300)
+//   --scenario : run only this one, ex) 1080p30_mjpeg. peak_rss_mb is per process,
+//                so run scenarios one by one when comparing memory.
+//   --pipeline : Webcam::set_pipeline(true)
+//   --copy     : allow stream copy (StreamMode::Auto). default forces decode + encode.
+//   --unpaced  : read as fast as possible instead of at the scenario frame rate
+//   --motion   : Webcam::set_motion(true). lavfi sources move all the time, so this
+//                mostly shows the detector cost (stages_us.motion).
+//   --filter   : Webcam::set_filter(0, SPEC). default none : frames bypass the filter graph.
+//   --encoder  : EncoderConfig::encoder, ex) libx264. default reencodes with the capture codec.
+//   --throughput : EncoderTuning::Throughput instead of LowLatency
+//   --decode-threads : DecoderConfig::thread_count, 1 : single threaded. default auto.
+//   --convert  : YuvToBgr against swscale instead of the capture scenarios. 1080p frames,
+//                ms per frame of each cpu path, whether the paths match byte for byte,
+//                and the largest difference to swscale (point, accurate rounding, same
+//                range and matrix). then SliceScaler against one context on 4k and
+//                1080p frames : view conversions, thumbnails and rendition sizes
+//                (fractional ratios too), ms per frame, slices and whether the output
+//                is the same. exits 1 when simd and scalar differ, swscale is further
+//                than swscale_tolerance, or slices differ from one context.
+//
+// linux :
+//   g++ -O2 -std=c++14 -I../ben/include bench.cpp -o bench -pthread
+//     -lavdevice -lavfilter -lavformat -lavcodec -lswresample -lswscale -lpostproc -lavutil
+// headless build (BEN_HEADLESS, from bench.vcxproj or defined below) : no viewer,
+// no opencv include or library needed.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+  #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+  #endif
+  #include <windows.h>
+  #include <psapi.h>
+  #pragma comment (lib, "psapi.lib")
+#else
+  #include <sys/resource.h>
+  #include <unistd.h>
+#endif
+
+#ifndef BEN_HEADLESS
+  #define BEN_HEADLESS
+#endif
+#include <ben/color.h>
+#include <ben/input.h>
+#include <ben/scaler.h>
+#include <ben/webcam.h>
+
+namespace bench {
+
+  struct Scenario
+  {
+    std::string name;
+    int width;
+    int height;
+    int fps;
+    bool mjpeg; // false : raw yuyv422
+  };
+
+  struct Options
+  {
+    int frames = 300;
+    std::string scenario;
+    bool pipeline = false;
+    bool copy = false;
+    bool paced = true;
+    bool motion = false;
+    std::string filter;
+    ben::EncoderConfig encoder;
+    ben::DecoderConfig decoder;
+    bool convert = false;
+  };
+
+  struct Result
+  {
+    uint64_t frames_in = 0;
+    uint64_t frames_out = 0;
+    double seconds = 0;
+    double fps = 0;
+    double latency_p50_ms = 0;
+    double latency_p90_ms = 0;
+    double latency_p99_ms = 0;
+    double latency_max_ms = 0;
+    double cpu_ms_per_frame = 0;
+    double peak_rss_mb = 0;
+    ben::CaptureStats stats;
+  };
+
+  typedef std::chrono::steady_clock Clock;
+
+  // quoted and escaped json string
+  std::string json_string(const std::string& text)
+  {
+    std::string out = "\"";
+    for (char c : text) {
+      unsigned char u = static_cast<unsigned char>(c);
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += c;
+      } else if (u < 0x20) {
+        char esc[8];
+        snprintf(esc, sizeof(esc), "\\u%04x", u);
+        out += esc;
+      } else {
+        out += c;
+      }
+    }
+    return out + "\"";
+  }
+
+  // name in the temp directory, with the process id : parallel runs do not collide
+  std::string temp_path(const std::string& name)
+  {
+#if defined(_WIN32)
+    char dir[MAX_PATH + 1] = { 0, };
+    if (!GetTempPathA(sizeof(dir), dir)) {
+      dir[0] = 0;
+    }
+    return std::string(dir) + std::to_string(GetCurrentProcessId()) + "_" + name;
+#else
+    const char* dir = getenv("TMPDIR");
+    std::string path = dir && *dir ? dir : "/tmp";
+    return path + "/" + std::to_string(getpid()) + "_" + name;
+#endif
+  }
+
+  // removes the file when it goes out of scope, after a throw too
+  class TempFile
+  {
+  private:
+    std::string path_;
+
+  public:
+    explicit TempFile(const std::string& path)
+      : path_(path)
+    {
+    }
+
+    ~TempFile()
+    {
+      std::remove(path_.c_str());
+    }
+
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+
+    const std::string& path() const
+    {
+      return path_;
+    }
+  };
+
+
+  // records when each packet left the source, by stream and pts.
+  // a muxed packet is matched by its pts within half a frame (timestamps go
+  // through the decoder, filter and encoder time bases), so dropped, gated and
+  // reordered packets never shift the pairing. packets of output streams that
+  // are no input stream (renditions) are not counted.
+  class TimedInput : public ben::Input
+  {
+  private:
+    // reads never written (dropped, motion gated) go first past this
+    static const std::size_t max_pending = 4096;
+
+    std::unique_ptr<ben::Input> input_;
+    std::mutex mutex_;
+    std::map<int, std::map<int64_t, Clock::time_point>> reads_; // pts in AV_TIME_BASE
+    std::map<int, int64_t> tolerance_us_;
+    std::vector<double> latencies_ms_;
+    uint64_t frames_in_ = 0;
+    const AVRational microseconds = { 1, AV_TIME_BASE };
+
+  public:
+    TimedInput(std::unique_ptr<ben::Input> input)
+      : input_(std::move(input))
+    {
+    }
+
+    void open() override { input_->open(); }
+    AVFormatContext* format_context() override { return input_->format_context(); }
+    void close() override { input_->close(); }
+    std::string name() const override { return input_->name(); }
+
+    int read(ben::ff::Packet& packet) override
+    {
+      int ret = input_->read(packet);
+      if (ret < 0) {
+        return ret;
+      }
+
+      Clock::time_point now = Clock::now();
+      std::lock_guard<std::mutex> lock(mutex_);
+      frames_in_++;
+      if (packet->pts == AV_NOPTS_VALUE) {
+        return ret;
+      }
+
+      int stream_index = packet->stream_index;
+      AVStream* stream = input_->format_context()->streams[stream_index];
+      if (!tolerance_us_.count(stream_index)) {
+        AVRational rate = stream->avg_frame_rate.num > 0 ? stream->avg_frame_rate : stream->r_frame_rate;
+        tolerance_us_[stream_index] = rate.num > 0 && rate.den > 0
+          ? av_rescale(AV_TIME_BASE / 2, rate.den, rate.num)
+          : 1000;
+      }
+
+      auto& reads = reads_[stream_index];
+      reads[av_rescale_q(packet->pts, stream->time_base, microseconds)] = now;
+      if (reads.size() > max_pending) {
+        reads.erase(reads.begin());
+      }
+      return ret;
+    }
+
+    // time_base : of the packet, Webcam::output_time_base
+    void written(const AVPacket* packet, AVRational time_base)
+    {
+      Clock::time_point now = Clock::now();
+      if (packet->pts == AV_NOPTS_VALUE || time_base.num <= 0) {
+        return;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = reads_.find(packet->stream_index);
+      if (it == reads_.end()) {
+        return;
+      }
+      auto& reads = it->second;
+      int64_t tolerance = tolerance_us_[packet->stream_index];
+      int64_t pts = av_rescale_q(packet->pts, time_base, microseconds);
+
+      auto match = reads.lower_bound(pts - tolerance);
+      if (match == reads.end() || match->first > pts + tolerance) {
+        return;
+      }
+      latencies_ms_.push_back(std::chrono::duration<double, std::milli>(now - match->second).count());
+      reads.erase(match);
+    }
+
+    uint64_t frames_in()
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return frames_in_;
+    }
+
+    std::vector<double> latencies_ms()
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return latencies_ms_;
+    }
+  };
+
+
+  class Bench : public ben::ff::Util
+  {
+  private:
+    Options opt_;
+
+  public:
+    Bench(const Options& opt)
+      : opt_(opt)
+    {
+      av_register_all();
+      avfilter_register_all();
+      avdevice_register_all();
+      ben::ff::Log::set_log(AV_LOG_ERROR);
+    }
+
+    static std::vector<Scenario> scenarios()
+    {
+      struct Size { const char* name; int width; int height; };
+      const Size sizes[] = { { "720p", 1280, 720 }, { "1080p", 1920, 1080 }, { "4k", 3840, 2160 } };
+      const int rates[] = { 30, 60 };
+
+      std::vector<Scenario> list;
+      for (const Size& size : sizes) {
+        for (int fps : rates) {
+          for (int mjpeg = 1; mjpeg >= 0; mjpeg--) {
+            Scenario sc;
+            sc.name = std::string(size.name) + std::to_string(fps) + (mjpeg ? "_mjpeg" : "_raw");
+            sc.width = size.width;
+            sc.height = size.height;
+            sc.fps = fps;
+            sc.mjpeg = mjpeg != 0;
+            list.push_back(sc);
+          }
+        }
+      }
+      return list;
+    }
+
+    void run_all()
+    {
+      printf("{\n");
+      printf("  \"frames\": %d, \"pipeline\": %s, \"copy\": %s, \"paced\": %s,\n",
+        opt_.frames, json_bool(opt_.pipeline), json_bool(opt_.copy), json_bool(opt_.paced));
+      printf("  \"results\": [\n");
+
+      bool first = true;
+      for (const Scenario& sc : scenarios()) {
+        if (!opt_.scenario.empty() && opt_.scenario != sc.name) {
+          continue;
+        }
+
+        if (!first) {
+          printf(",\n");
+        }
+        first = false;
+
+        try {
+          print(sc, run(sc));
+        } catch (std::runtime_error& e) {
+          printf("    { \"scenario\": \"%s\", \"error\": %s }", sc.name.c_str(), json_string(e.what()).c_str());
+        }
+        fflush(stdout);
+      }
+
+      printf("\n  ]\n}\n");
+    }
+
+  private:
+    Result run(const Scenario& sc)
+    {
+      // before the input and the webcam : removed once they closed it
+      TempFile clip(temp_path("bench_" + sc.name + ".mkv"));
+
+      std::unique_ptr<ben::FormatInput> source;
+      if (sc.mjpeg) {
+        // lavfi can not produce mjpeg packets : encode a clip for the scenario
+        make_mjpeg_clip(sc, clip.path());
+        source.reset(new ben::FormatInput(clip.path()));
+      } else {
+        source.reset(new ben::FormatInput(lavfi_url(sc, "yuyv422", true), "lavfi"));
+      }
+      source->set_realtime(opt_.paced);
+
+      TimedInput* timed = new TimedInput(std::move(source));
+      std::unique_ptr<ben::Input> input(timed);
+
+      ben::Webcam wc;
+      wc.set_view(false);
+      wc.set_output_format("null");
+      wc.set_pipeline(opt_.pipeline);
+      wc.set_motion(opt_.motion);
+      wc.set_filter(0, opt_.filter);
+      wc.set_decoder(0, opt_.decoder);
+      wc.set_stream_mode(0, opt_.copy ? ben::StreamMode::Auto : ben::StreamMode::Encode);
+      ben::Webcam* webcam = &wc;
+      wc.set_write_callback([timed, webcam](const AVPacket* packet) {
+        timed->written(packet, webcam->output_time_base(packet->stream_index));
+      });
+
+      double cpu_start = cpu_seconds();
+      Clock::time_point start = Clock::now();
+
+      if (!wc.start_capture(std::move(input), "bench", opt_.encoder)) {
+        throw std::runtime_error(wc.last_err());
+      }
+      while (wc.capturing()) {
+      }
+      if (!wc.eof()) {
+        throw std::runtime_error(wc.last_err());
+      }
+      if (!wc.end_capture()) {
+        throw std::runtime_error(wc.last_err());
+      }
+
+      Result r;
+      r.stats = wc.stats();
+      r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+      double cpu = cpu_seconds() - cpu_start;
+
+      std::vector<double> lat = timed->latencies_ms();
+      std::sort(lat.begin(), lat.end());
+
+      r.frames_in = timed->frames_in();
+      r.frames_out = lat.size();
+      r.fps = r.seconds > 0 ? r.frames_out / r.seconds : 0;
+      r.latency_p50_ms = percentile(lat, 0.50);
+      r.latency_p90_ms = percentile(lat, 0.90);
+      r.latency_p99_ms = percentile(lat, 0.99);
+      r.latency_max_ms = lat.empty() ? 0 : lat.back();
+      r.cpu_ms_per_frame = r.frames_out ? cpu * 1000.0 / r.frames_out : 0;
+      r.peak_rss_mb = peak_rss_mb();
+      return r;
+    }
+
+    std::string lavfi_url(const Scenario& sc, const char* pix_fmt, bool limit)
+    {
+      char url[256] = { 0, };
+      snprintf(url, sizeof(url), "testsrc=size=%dx%d:rate=%d", sc.width, sc.height, sc.fps);
+
+      std::string s = url;
+      if (limit) {
+        // whole seconds are enough, extra frames only make the run longer
+        int seconds = (opt_.frames + sc.fps - 1) / sc.fps;
+        s += ":duration=" + std::to_string(seconds);
+      }
+      s += ",format=";
+      s += pix_fmt;
+      return s;
+    }
+
+    // opt_.frames of testsrc encoded to mjpeg (yuvj422p like usb webcams)
+    void make_mjpeg_clip(const Scenario& sc, const std::string& path)
+    {
+      ben::FormatInput src(lavfi_url(sc, "yuvj422p", false), "lavfi");
+      src.open();
+
+      AVFormatContext* ifmt_ctx = src.format_context();
+      AVStream* in_stream = ifmt_ctx->streams[0];
+
+      AVCodecContext* dec_ctx = nullptr;
+      AVCodecContext* enc_ctx = nullptr;
+      AVFormatContext* ofmt_ctx = nullptr;
+
+      try {
+        AVCodec* dec = avcodec_find_decoder(in_stream->codecpar->codec_id);
+        chk(dec, "clip avcodec_find_decoder");
+        dec_ctx = avcodec_alloc_context3(dec);
+        chk(dec_ctx, "clip avcodec_alloc_context3 dec");
+        chk(avcodec_parameters_to_context(dec_ctx, in_stream->codecpar), "clip avcodec_parameters_to_context");
+        chk(avcodec_open2(dec_ctx, dec, NULL), "clip avcodec_open2 dec");
+
+        AVCodec* enc = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+        chk(enc, "clip avcodec_find_encoder mjpeg");
+        enc_ctx = avcodec_alloc_context3(enc);
+        chk(enc_ctx, "clip avcodec_alloc_context3 enc");
+        enc_ctx->width = sc.width;
+        enc_ctx->height = sc.height;
+        enc_ctx->pix_fmt = AV_PIX_FMT_YUVJ422P;
+        enc_ctx->time_base = AVRational{ 1, sc.fps };
+
+        chk(
+          avformat_alloc_output_context2(&ofmt_ctx, NULL, NULL, path.c_str()),
+          "clip avformat_alloc_output_context2 : %s", path.c_str()
+        );
+        if (ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+          enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+        chk(avcodec_open2(enc_ctx, enc, NULL), "clip avcodec_open2 enc");
+
+        AVStream* out_stream = avformat_new_stream(ofmt_ctx, NULL);
+        chk(out_stream, "clip avformat_new_stream");
+        chk(avcodec_parameters_from_context(out_stream->codecpar, enc_ctx), "clip avcodec_parameters_from_context");
+        out_stream->time_base = enc_ctx->time_base;
+
+        chk(avio_open(&ofmt_ctx->pb, path.c_str(), AVIO_FLAG_WRITE), "clip avio_open : %s", path.c_str());
+        chk(avformat_write_header(ofmt_ctx, NULL), "clip avformat_write_header");
+
+        ben::ff::Packet packet;
+        ben::ff::Frame frame;
+        for (int n = 0; n < opt_.frames; ) {
+          chk(src.read(packet), "clip read");
+          chk(avcodec_send_packet(dec_ctx, packet), "clip avcodec_send_packet");
+          packet.unref();
+
+          if (avcodec_receive_frame(dec_ctx, frame) < 0) {
+            continue;
+          }
+          frame->pts = n++;
+          write_clip_frame(enc_ctx, ofmt_ctx, frame);
+          frame.unref();
+        }
+        write_clip_frame(enc_ctx, ofmt_ctx, nullptr);
+
+        chk(av_write_trailer(ofmt_ctx), "clip av_write_trailer");
+      } catch (std::runtime_error&) {
+        close_clip(dec_ctx, enc_ctx, ofmt_ctx);
+        throw;
+      }
+      close_clip(dec_ctx, enc_ctx, ofmt_ctx);
+    }
+
+    void write_clip_frame(AVCodecContext* enc_ctx, AVFormatContext* ofmt_ctx, AVFrame* frame)
+    {
+      chk(avcodec_send_frame(enc_ctx, frame), "clip avcodec_send_frame");
+
+      ben::ff::Packet packet;
+      while (avcodec_receive_packet(enc_ctx, packet) >= 0) {
+        packet->stream_index = 0;
+        av_packet_rescale_ts(packet, enc_ctx->time_base, ofmt_ctx->streams[0]->time_base);
+        chk(av_interleaved_write_frame(ofmt_ctx, packet), "clip av_interleaved_write_frame");
+      }
+    }
+
+    static void close_clip(AVCodecContext*& dec_ctx, AVCodecContext*& enc_ctx, AVFormatContext*& ofmt_ctx)
+    {
+      avcodec_free_context(&dec_ctx);
+      avcodec_free_context(&enc_ctx);
+      if (ofmt_ctx) {
+        avio_closep(&ofmt_ctx->pb);
+        avformat_free_context(ofmt_ctx);
+        ofmt_ctx = nullptr;
+      }
+    }
+
+    static double percentile(const std::vector<double>& sorted, double p)
+    {
+      if (sorted.empty()) {
+        return 0;
+      }
+      size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+      return sorted[std::min(index, sorted.size() - 1)];
+    }
+
+    static double cpu_seconds()
+    {
+#if defined(_WIN32)
+      FILETIME create_time, exit_time, kernel_time, user_time;
+      GetProcessTimes(GetCurrentProcess(), &create_time, &exit_time, &kernel_time, &user_time);
+      ULARGE_INTEGER k, u;
+      k.LowPart = kernel_time.dwLowDateTime;
+      k.HighPart = kernel_time.dwHighDateTime;
+      u.LowPart = user_time.dwLowDateTime;
+      u.HighPart = user_time.dwHighDateTime;
+      return (k.QuadPart + u.QuadPart) / 1e7;
+#else
+      rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+        + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#endif
+    }
+
+    static double peak_rss_mb()
+    {
+#if defined(_WIN32)
+      PROCESS_MEMORY_COUNTERS pmc;
+      GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+      return pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+      rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      return usage.ru_maxrss / 1024.0; // KB on linux
+#endif
+    }
+
+    static const char* json_bool(bool b)
+    {
+      return b ? "true" : "false";
+    }
+
+    static void print(const Scenario& sc, const Result& r)
+    {
+      printf(
+        "    { \"scenario\": \"%s\", \"width\": %d, \"height\": %d, \"target_fps\": %d, \"format\": \"%s\",\n"
+        "      \"frames_in\": %llu, \"frames_out\": %llu, \"seconds\": %.3f, \"fps\": %.2f,\n"
+        "      \"latency_ms\": { \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n"
+        "      \"cpu_ms_per_frame\": %.3f, \"peak_rss_mb\": %.1f, \"dropped\": %llu, \"skipped\": %llu,\n",
+        sc.name.c_str(), sc.width, sc.height, sc.fps, sc.mjpeg ? "mjpeg" : "raw",
+        (unsigned long long)r.frames_in, (unsigned long long)r.frames_out, r.seconds, r.fps,
+        r.latency_p50_ms, r.latency_p90_ms, r.latency_p99_ms, r.latency_max_ms,
+        r.cpu_ms_per_frame, r.peak_rss_mb, (unsigned long long)r.stats.frames_dropped,
+        (unsigned long long)r.stats.frames_skipped
+      );
+
+      printf("      \"stages_us\": {");
+      for (int i = 0; i < ben::stage_count; i++) {
+        const ben::StageStats& st = r.stats.stages[i];
+        printf(
+          "%s\n        \"%s\": { \"count\": %llu, \"p50\": %llu, \"p99\": %llu, \"max\": %llu }",
+          i ? "," : "",
+          ben::stage_name(static_cast<ben::Stage>(i)),
+          (unsigned long long)st.count,
+          (unsigned long long)st.p50_us,
+          (unsigned long long)st.p99_us,
+          (unsigned long long)st.max_us
+        );
+      }
+      printf("\n      } }");
+    }
+  };
+
+  // viewer conversion : YuvToBgr paths and swscale on the same frames
+  // exits non zero when a check fails
+  class ConvertBench : public ben::ff::Util
+  {
+  private:
+    // YuvToBgr against swscale set up the same way (point, accurate rounding,
+    // range and matrix) : 16 bit fixed point against swscale's own rounding
+    static const int swscale_tolerance = 2;
+
+    Options opt_;
+    bool pass_ = true;
+
+  public:
+    ConvertBench(const Options& opt)
+      : opt_(opt)
+    {
+      ben::ff::Log::set_log(AV_LOG_ERROR);
+    }
+
+    void run_all()
+    {
+      const int width = 1920;
+      const int height = 1080;
+      const AVPixelFormat formats[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV422P, AV_PIX_FMT_NV12, AV_PIX_FMT_YUYV422 };
+
+      printf("{\n");
+      printf("  \"frames\": %d, \"width\": %d, \"height\": %d, \"cpu\": \"%s\",\n",
+        opt_.frames, width, height, path_name(ben::YuvToBgr::cpu()));
+      printf("  \"convert\": [\n");
+
+      bool first = true;
+      for (AVPixelFormat format : formats) {
+        for (int full = 0; full <= 1; full++) {
+          if (!first) {
+            printf(",\n");
+          }
+          first = false;
+
+          try {
+            run(format, full != 0, width, height);
+          } catch (std::runtime_error& e) {
+            printf("    { \"format\": \"%s\", \"error\": %s }", av_get_pix_fmt_name(format), json_string(e.what()).c_str());
+            pass_ = false;
+          }
+          fflush(stdout);
+        }
+      }
+      printf("\n  ],\n");
+
+      // SliceScaler against one context (threads 1)
+      struct Case { const char* name; AVPixelFormat src; AVPixelFormat dst; int src_height; int width; int height; int flags; };
+      const Case cases[] = {
+        { "view_yuv420p_kernel", AV_PIX_FMT_YUV420P, AV_PIX_FMT_BGR24, 2160, 3840, 2160, SWS_POINT },
+        { "view_yuv444p_sws", AV_PIX_FMT_YUV444P, AV_PIX_FMT_BGR24, 2160, 3840, 2160, SWS_POINT },
+        { "view_yuv420p_bicubic", AV_PIX_FMT_YUV420P, AV_PIX_FMT_BGRA, 2160, 3840, 2160, SWS_BICUBIC },
+        { "thumb_half_bicubic", AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV420P, 2160, 1920, 1080, SWS_BICUBIC },
+        { "thumb_quarter_area", AV_PIX_FMT_YUV420P, AV_PIX_FMT_BGR24, 2160, 960, 540, SWS_AREA },
+        { "thumb_third_bilinear", AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV420P, 2160, 1280, 720, SWS_BILINEAR },
+        // fractional ratios (3/2, 9/4, 15/8) : renditions and analytics sizes
+        { "rendition_1080p_720p_bicubic", AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV420P, 1080, 1280, 720, SWS_BICUBIC },
+        { "rendition_1080p_480p_bicubic", AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV420P, 1080, 854, 480, SWS_BICUBIC },
+        { "analytics_1080p_576p_bilinear", AV_PIX_FMT_YUV420P, AV_PIX_FMT_BGR24, 1080, 1024, 576, SWS_BILINEAR },
+        // 27/10 : one context, slices 1
+        { "fallback_1080p_400p_bicubic", AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV420P, 1080, 712, 400, SWS_BICUBIC }
+      };
+      printf("  \"slices\": [\n");
+      first = true;
+      for (const Case& c : cases) {
+        if (!first) {
+          printf(",\n");
+        }
+        first = false;
+
+        try {
+          run_slices(c.name, c.src, c.dst, c.src_height, c.width, c.height, c.flags);
+        } catch (std::runtime_error& e) {
+          printf("    { \"case\": \"%s\", \"error\": %s }", c.name, json_string(e.what()).c_str());
+          pass_ = false;
+        }
+        fflush(stdout);
+      }
+
+      printf("\n  ],\n");
+      printf("  \"swscale_tolerance\": %d, \"pass\": %s\n}\n", swscale_tolerance, pass_ ? "true" : "false");
+    }
+
+    bool pass() const
+    {
+      return pass_;
+    }
+
+  private:
+    // src_height : 2160 (3840 wide) or 1080 (1920 wide)
+    void run_slices(const char* name, AVPixelFormat src_format, AVPixelFormat dst_format, int src_height, int width, int height, int flags)
+    {
+      ben::ff::Frame src;
+      src->format = src_format;
+      src->width = src_height * 16 / 9;
+      src->height = src_height;
+      src->color_range = AVCOL_RANGE_MPEG;
+      chk(av_frame_get_buffer(src, 32), "slices av_frame_get_buffer");
+      fill_noise(src);
+
+      ben::ff::Frame dst[2];
+      for (ben::ff::Frame& frame : dst) {
+        frame->format = dst_format;
+        frame->width = width;
+        frame->height = height;
+        chk(av_frame_get_buffer(frame, 32), "slices av_frame_get_buffer");
+      }
+
+      ben::SliceScaler single(1, flags);
+      ben::SliceScaler sliced(0, flags);
+      ben::SliceScaler* scalers[2] = { &single, &sliced };
+      double ms[2] = { 0, 0 };
+      for (int i = 0; i < 2; i++) {
+        Clock::time_point start = Clock::now();
+        for (int n = 0; n < opt_.frames; n++) {
+          scalers[i]->scale(src, dst[i]);
+        }
+        ms[i] = ms_since(start) / opt_.frames;
+      }
+
+      bool equal = true;
+      const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(dst_format);
+      for (int p = 0; p < av_pix_fmt_count_planes(dst_format); p++) {
+        int shift = p == 1 || p == 2 ? desc->log2_chroma_h : 0;
+        int rows = -((-height) >> shift);
+        int bytes = av_image_get_linesize(dst_format, width, p);
+        for (int y = 0; y < rows; y++) {
+          if (memcmp(dst[0]->data[p] + y * dst[0]->linesize[p], dst[1]->data[p] + y * dst[1]->linesize[p], bytes)) {
+            equal = false;
+          }
+        }
+      }
+
+      // slices must give the output of one context byte for byte
+      pass_ = pass_ && equal;
+
+      printf(
+        "    { \"case\": \"%s\", \"src_height\": %d, \"width\": %d, \"height\": %d, \"slices\": %zu,"
+        " \"single_ms\": %.3f, \"sliced_ms\": %.3f, \"equal\": %s }",
+        name, src_height, width, height, sliced.slices(), ms[0], ms[1], equal ? "true" : "false"
+      );
+    }
+
+    // noise : every pixel and chroma value in use, no flat areas
+    static void fill_noise(AVFrame* frame)
+    {
+      AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+      const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+      uint32_t seed = 1;
+      for (int p = 0; p < 4 && frame->data[p]; p++) {
+        int shift = p == 1 || p == 2 ? desc->log2_chroma_h : 0;
+        int rows = -((-frame->height) >> shift);
+        for (int y = 0; y < rows; y++) {
+          uint8_t* row = frame->data[p] + y * frame->linesize[p];
+          for (int x = 0; x < frame->linesize[p]; x++) {
+            seed = seed * 1664525 + 1013904223;
+            row[x] = static_cast<uint8_t>(seed >> 24);
+          }
+        }
+      }
+    }
+
+    void run(AVPixelFormat format, bool full, int width, int height)
+    {
+      ben::ff::Frame src;
+      src->format = format;
+      src->width = width;
+      src->height = height;
+      src->color_range = full ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+      src->colorspace = AVCOL_SPC_BT470BG;
+      chk(av_frame_get_buffer(src, 32), "convert av_frame_get_buffer");
+      fill_noise(src);
+
+      int linesize = width * 3;
+      std::vector<uint8_t> out[3];
+      double path_ms[3] = { -1, -1, -1 };
+      for (int path = 0; path <= static_cast<int>(ben::YuvToBgr::cpu()); path++) {
+        out[path].resize(linesize * height);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < opt_.frames; i++) {
+          ben::YuvToBgr::convert(src, out[path].data(), linesize, static_cast<ben::ColorCpu>(path));
+        }
+        path_ms[path] = ms_since(start) / opt_.frames;
+      }
+
+      bool equal = true;
+      for (int path = 1; path < 3; path++) {
+        if (!out[path].empty() && out[path] != out[0]) {
+          equal = false;
+        }
+      }
+
+      // the viewer's swscale fallback : point, accurate rounding, same range and matrix
+      SwsContext* sws = sws_getContext(
+        width, height, ben::ff::PixFmt::limited(format),
+        width, height, AV_PIX_FMT_BGR24,
+        SWS_POINT | SWS_ACCURATE_RND, NULL, NULL, NULL
+      );
+      chk(sws, "convert sws_getContext");
+      const int* coeffs = sws_getCoefficients(SWS_CS_ITU601);
+      sws_setColorspaceDetails(sws, coeffs, full ? 1 : 0, coeffs, 1, 0, 1 << 16, 1 << 16);
+
+      std::vector<uint8_t> ref(linesize * height);
+      uint8_t* dst[4] = { ref.data(), nullptr, nullptr, nullptr };
+      int dst_linesize[4] = { linesize, 0, 0, 0 };
+      Clock::time_point start = Clock::now();
+      for (int i = 0; i < opt_.frames; i++) {
+        sws_scale(sws, src->data, src->linesize, 0, height, dst, dst_linesize);
+      }
+      double sws_ms = ms_since(start) / opt_.frames;
+      sws_freeContext(sws);
+
+      int max_diff = 0;
+      for (std::size_t i = 0; i < ref.size(); i++) {
+        max_diff = std::max(max_diff, std::abs(static_cast<int>(ref[i]) - static_cast<int>(out[0][i])));
+      }
+
+      // simd paths byte for byte the scalar one, all of them close to swscale
+      bool pass = equal && max_diff <= swscale_tolerance;
+      pass_ = pass_ && pass;
+
+      printf(
+        "    { \"format\": \"%s\", \"range\": \"%s\", \"swscale_ms\": %.3f,"
+        " \"scalar_ms\": %.3f, \"sse4_ms\": %s, \"avx2_ms\": %s,"
+        " \"paths_equal\": %s, \"max_diff_swscale\": %d, \"pass\": %s }",
+        av_get_pix_fmt_name(format), full ? "full" : "limited", sws_ms,
+        path_ms[0], json_ms(path_ms[1]).c_str(), json_ms(path_ms[2]).c_str(),
+        equal ? "true" : "false", max_diff, pass ? "true" : "false"
+      );
+    }
+
+    static double ms_since(Clock::time_point start)
+    {
+      return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    // null : path not on this cpu
+    static std::string json_ms(double ms)
+    {
+      if (ms < 0) {
+        return "null";
+      }
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%.3f", ms);
+      return buf;
+    }
+
+    static const char* path_name(ben::ColorCpu path)
+    {
+      switch (path) {
+      case ben::ColorCpu::AVX2: return "avx2";
+      case ben::ColorCpu::SSE4: return "sse4";
+      default: return "scalar";
+      }
+    }
+  };
+}
+
+
+int main(int argc, const char** argv)
+{
+  bench::Options opt;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--frames" && i + 1 < argc) {
+      opt.frames = std::max(1, atoi(argv[++i]));
+    } else if (arg == "--scenario" && i + 1 < argc) {
+      opt.scenario = argv[++i];
+    } else if (arg == "--pipeline") {
+      opt.pipeline = true;
+    } else if (arg == "--copy") {
+      opt.copy = true;
+    } else if (arg == "--unpaced") {
+      opt.paced = false;
+    } else if (arg == "--motion") {
+      opt.motion = true;
+    } else if (arg == "--filter" && i + 1 < argc) {
+      opt.filter = argv[++i];
+    } else if (arg == "--encoder" && i + 1 < argc) {
+      opt.encoder.encoder = argv[++i];
+    } else if (arg == "--throughput") {
+      opt.encoder.tuning = ben::EncoderTuning::Throughput;
+    } else if (arg == "--convert") {
+      opt.convert = true;
+    } else if (arg == "--decode-threads" && i + 1 < argc) {
+      opt.decoder.thread_count = std::max(1, atoi(argv[++i]));
+    } else {
+      fprintf(stderr, "unknown option : %s\n", arg.c_str());
+      return -1;
+    }
+  }
+
+  if (opt.convert) {
+    bench::ConvertBench c(opt);
+    c.run_all();
+    return c.pass() ? 0 : 1;
+  }
+
+  bench::Bench b(opt);
+  b.run_all();
+  return 0;
+}